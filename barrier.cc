@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// A replication barrier waits until every change made below a path
+// before the barrier was issued has reached the shadow, so that a
+// remote build can safely start on the shadow copy. Barriers are
+// requested over a unix socket at $DATA_DIR/.barrier, one per
+// connection, with a line holding the (escaped) path and a timeout
+// in ms (0 for none), and are answered with "ok" or "error <reason>".
+// "shadowfs --barrier <mount>[/<dir>]" is the client.
+//
+// Nothing is fsynced: the barrier flushes what shadowfs itself holds
+// back and then waits for the replication queues, the retry queue and
+// the journal to get past it.
+//
+// The socket is open to every local user, since the builds that need
+// barriers usually run as someone other than the daemon. A barrier
+// only sends on early what would reach the shadow anyway, and reveals
+// nothing but whether a mount is caught up.
+
+#define BARRIER_POLL_MS 100
+
+// Barriers in progress at once; connections over this are turned away
+// with "error busy", since any local user can make them.
+#define BARRIER_MAX 32
+
+static int             listen_fd_ = -1;
+static pthread_t       acceptor_;
+static bool            running_  = false;
+static unsigned        active_   = 0;     // barriers in progress
+static pthread_mutex_t lock_     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  idle_cv_  = PTHREAD_COND_INITIALIZER;
+
+static std::string
+socket_path()
+{
+    return DATA_DIR + "/.barrier";
+}
+
+static bool
+barrier_running()
+{
+    pthread_mutex_lock(&lock_);
+    bool running = running_;
+    pthread_mutex_unlock(&lock_);
+    return running;
+}
+
+// Runs a barrier on dir, returning NULL once it's passed or the reason
+// it failed.
+static const char*
+run_barrier(const std::string& dir, unsigned timeout_ms)
+{
+    if (is_local_only(dir.c_str())) {
+        return NULL;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    // what's held back is held back for all of the mount's targets
+    std::string root = root_dir(dir.c_str());
+    const std::string& source = _mtab.find(root)->second.source_;
+    if (source.empty()) {
+        flush_under(dir.c_str());
+    } else {
+        flush_under(target_path(dir, source).c_str());
+    }
+    unsigned long mark = replicate_mark();
+
+    while (1) {
+        // changes that were journaled can't reach the shadow until it
+        // comes back, which could be a long time
+        if (is_offline(dir.c_str())) {
+            return "shadow offline";
+        }
+
+        if (replicate_barrier(dir, mark, BARRIER_POLL_MS) &&
+            ! retry_pending_under(dir) && ! journal_pending(dir.c_str()))
+        {
+            return NULL;
+        }
+
+        if (! barrier_running()) {
+            return "shadowfs stopping";
+        }
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                          (now.tv_usec - start.tv_usec) / 1000;
+        if (timeout_ms != 0 && elapsed_ms >= (long)timeout_ms) {
+            return "timed out";
+        }
+
+        // replicate_barrier only waits while the queues have work
+        if (retry_pending_under(dir) || journal_pending(dir.c_str())) {
+            usleep(BARRIER_POLL_MS * 1000);
+        }
+    }
+}
+
+static bool
+read_line(int fd, std::string* line)
+{
+    char c;
+    while (line->size() < PATH_MAX * 3 + 32) {
+        ssize_t n = read(fd, &c, 1);
+        if (n != 1) {
+            return false;
+        }
+        if (c == '\n') {
+            return true;
+        }
+        line->push_back(c);
+    }
+    return false;
+}
+
+static void*
+handle_barrier(void* arg)
+{
+    int fd = (int)(long)arg;
+
+    std::string line, reply;
+    char path[PATH_MAX * 3 + 32];
+    unsigned timeout_ms;
+    if (! read_line(fd, &line) ||
+        sscanf(line.c_str(), "%s %u", path, &timeout_ms) != 2)
+    {
+        reply = "error bad request\n";
+    } else {
+        std::string dir = unescape_path(path);
+        while (dir.size() > 1 && dir[dir.size() - 1] == '/') {
+            dir.erase(dir.size() - 1);
+        }
+
+        const char* err;
+        if (dir[0] != '/' || _mtab.find(root_dir(dir.c_str())) == _mtab.end()) {
+            err = "no such mount";
+        } else {
+            dsyslog("barrier(%s)\n", dir.c_str());
+            err = run_barrier(dir, timeout_ms);
+            dsyslog("barrier(%s): %s\n", dir.c_str(), err ? err : "ok");
+        }
+        reply = err ? std::string("error ") + err + "\n" : "ok\n";
+    }
+
+    if (write(fd, reply.data(), reply.size()) != (ssize_t)reply.size()) {
+        dsyslog("barrier: error writing reply: %s\n", strerror(errno));
+    }
+    close(fd);
+
+    pthread_mutex_lock(&lock_);
+    if (--active_ == 0) {
+        pthread_cond_broadcast(&idle_cv_);
+    }
+    pthread_mutex_unlock(&lock_);
+    return NULL;
+}
+
+static void*
+acceptor(void*)
+{
+    while (barrier_running()) {
+        struct pollfd pfd;
+        pfd.fd     = listen_fd_;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, BARRIER_POLL_MS * 10) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd_, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        // a client that connects and never says anything mustn't
+        // keep a thread forever
+        struct timeval tv;
+        tv.tv_sec  = 10;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        // barriers can take a while, so each gets its own thread
+        pthread_mutex_lock(&lock_);
+        bool busy = active_ >= BARRIER_MAX;
+        if (! busy) {
+            active_++;
+        }
+        pthread_mutex_unlock(&lock_);
+
+        if (busy) {
+            static const char reply[] = "error busy\n";
+            ssize_t len = sizeof(reply) - 1;
+            if (write(fd, reply, len) != len) {
+                dsyslog("barrier: error writing reply: %s\n", strerror(errno));
+            }
+            close(fd);
+            continue;
+        }
+
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&tid, &attr, handle_barrier, (void*)(long)fd);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+            close(fd);
+            pthread_mutex_lock(&lock_);
+            active_--;
+            pthread_mutex_unlock(&lock_);
+        }
+    }
+    return NULL;
+}
+
+void
+start_barrier()
+{
+    std::string path = socket_path();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "barrier socket path %s too long\n", path.c_str());
+        return;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listen_fd_ == -1 ||
+        bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        chmod(path.c_str(), 0666) != 0 ||
+        listen(listen_fd_, 16) != 0)
+    {
+        syslog(LOG_ERR, "error creating barrier socket %s: %s\n",
+               path.c_str(), strerror(errno));
+        if (listen_fd_ != -1) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+        }
+        return;
+    }
+
+    running_ = true;
+    int err = pthread_create(&acceptor_, NULL, acceptor, NULL);
+    if (err != 0) {
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        running_ = false;
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+}
+
+void
+stop_barrier()
+{
+    if (listen_fd_ == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock_);
+    running_ = false;
+    pthread_mutex_unlock(&lock_);
+    pthread_join(acceptor_, NULL);
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(socket_path().c_str());
+
+    // barriers in progress notice that we're stopping within a poll
+    pthread_mutex_lock(&lock_);
+    while (active_ != 0) {
+        pthread_cond_wait(&idle_cv_, &lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+// Runs shadowfs --barrier with the arguments that follow it, and
+// returns the exit status. The daemon may be someone else's, so its
+// socket can be given instead of the one in our own data dir.
+int
+barrier_main(int argc, char* argv[])
+{
+    unsigned timeout_secs = 0;
+    std::string sock = socket_path();
+    bool usage = argc < 1;
+    for (int i = 1; i < argc && ! usage; i += 2) {
+        if (i + 1 == argc) {
+            usage = true;
+        } else if (! strcmp(argv[i], "--timeout")) {
+            timeout_secs = atoi(argv[i + 1]);
+        } else if (! strcmp(argv[i], "--socket")) {
+            sock = argv[i + 1];
+        } else {
+            usage = true;
+        }
+    }
+    if (usage) {
+        fprintf(stderr, "usage: shadowfs --barrier <mount>[/<dir>] "
+                "[--timeout SECS] [--socket PATH]\n");
+        return 2;
+    }
+
+    std::string request;
+    escape_path(&request, std::string("/") + argv[0]);
+    char buf[32];
+    snprintf(buf, sizeof(buf), " %u\n", timeout_secs * 1000);
+    request.append(buf);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sock.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "barrier socket path %s too long\n", sock.c_str());
+        return 2;
+    }
+    strcpy(addr.sun_path, sock.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "can't connect to shadowfs at %s: %s\n",
+                addr.sun_path, strerror(errno));
+        return 1;
+    }
+
+    std::string reply;
+    errno = 0;
+    if (write(fd, request.data(), request.size()) != (ssize_t)request.size() ||
+        ! read_line(fd, &reply))
+    {
+        fprintf(stderr, "barrier failed: %s\n",
+                errno ? strerror(errno) : "no reply");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (reply != "ok") {
+        fprintf(stderr, "barrier failed: %s\n", reply.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <deque>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// The attributes of local files are cached by path for attr_cache_secs,
+// since getattr is by far the most frequent call, and all changes to
+// DATA_DIR come through shadowfs. Every mutating op drops the entries
+// it affects, and a directory's entry goes along with those of the
+// entries created or removed in it, since its times and link count
+// change with them.
+//
+// Paths found missing are remembered for negative_cache_secs in a
+// separate, smaller table, so that a compiler searching its include
+// path doesn't cost an lstat per directory per header. Creating an
+// entry drops it from there like any other change.
+//
+// Directory listings are kept for dir_cache_secs, and dropped along
+// with the directory's attributes. With prefetch_threads, a fresh
+// listing also has the attributes of its entries looked up in the
+// background, since ls -l, make and the like stat everything they
+// list; by the time they ask, the answers are in the cache.
+//
+// An lstat that races with a change could put back what the change
+// just dropped, so lookups hand out an epoch for the path that the
+// result is put under, and the put is skipped if the path has been
+// invalidated since. Epochs are kept per slot of a small hash table
+// rather than per path, which at worst skips a few more puts.
+
+#define ATTR_CACHE_MAX      65536  // entries before the cache is emptied
+#define NEGATIVE_CACHE_MAX  16384
+#define DIR_CACHE_MAX       4096
+#define EPOCH_SLOTS         256
+#define PREFETCH_CHUNK      256    // entries per prefetch job
+#define PREFETCH_QUEUE_MAX  64     // jobs queued before listings are skipped
+
+struct AttrEntry {
+    struct stat st_;
+    time_t      expires_;
+};
+
+typedef std::map<std::string, AttrEntry> AttrTable;
+typedef std::map<std::string, time_t> NegativeTable;
+
+struct DirEntry {
+    DirListing listing_;
+    time_t     expires_;
+};
+
+typedef std::map<std::string, DirEntry> DirTable;
+
+static AttrTable        attrs_;
+static NegativeTable    negatives_;
+static DirTable         listings_;
+static unsigned long    epochs_[EPOCH_SLOTS];
+static pthread_rwlock_t cache_lock_ = PTHREAD_RWLOCK_INITIALIZER;
+
+// A run of names in one directory whose attributes are to be cached.
+struct PrefetchJob {
+    std::string dir_;
+    std::string names_;  // packed as in DirListing
+};
+
+static std::deque<PrefetchJob*> prefetch_queue_;
+static std::vector<pthread_t>   prefetchers_;
+static bool                     prefetch_running_ = false;
+static pthread_mutex_t          prefetch_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           prefetch_cv_   = PTHREAD_COND_INITIALIZER;
+
+static bool
+caching()
+{
+    return _config.attr_cache_secs_ != 0 || _config.negative_cache_secs_ != 0 ||
+           _config.dir_cache_secs_ != 0;
+}
+
+static unsigned long*
+epoch_slot(const std::string& path)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (size_t i = 0; i < path.size(); ++i) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619U;
+    }
+    return &epochs_[h % EPOCH_SLOTS];
+}
+
+static std::string
+parent_dir(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Looks up path, returning true on a hit with *err set to 0 and its
+// attributes in st, or to -ENOENT if it's known to be missing. On a
+// miss, *epoch is set for the attr_cache_put of the result.
+bool
+attr_cache_get(const char* path, struct stat* st, int* err, unsigned long* epoch)
+{
+    if (! caching()) {
+        return false;
+    }
+
+    std::string key(path);
+    time_t now = time(NULL);
+    bool hit = false;
+
+    pthread_rwlock_rdlock(&cache_lock_);
+    AttrTable::const_iterator iter = attrs_.find(key);
+    if (iter != attrs_.end() && iter->second.expires_ > now) {
+        *st  = iter->second.st_;
+        *err = 0;
+        hit  = true;
+    } else {
+        NegativeTable::const_iterator neg = negatives_.find(key);
+        if (neg != negatives_.end() && neg->second > now) {
+            *err = -ENOENT;
+            hit  = true;
+        }
+    }
+    if (! hit) {
+        *epoch = *epoch_slot(key);
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+    return hit;
+}
+
+void
+attr_cache_put(const char* path, const struct stat& st, unsigned long epoch)
+{
+    // A file with other names changes with them, which we can't track
+    if (_config.attr_cache_secs_ == 0 ||
+        (! S_ISDIR(st.st_mode) && st.st_nlink > 1))
+    {
+        return;
+    }
+
+    std::string key(path);
+    pthread_rwlock_wrlock(&cache_lock_);
+    if (*epoch_slot(key) == epoch) {
+        if (attrs_.size() >= ATTR_CACHE_MAX) {
+            attrs_.clear();
+        }
+        AttrEntry& entry = attrs_[key];
+        entry.st_      = st;
+        entry.expires_ = time(NULL) + _config.attr_cache_secs_;
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+// Records that path doesn't exist, as of the lookup that got epoch.
+void
+negative_cache_put(const char* path, unsigned long epoch)
+{
+    if (_config.negative_cache_secs_ == 0) {
+        return;
+    }
+
+    std::string key(path);
+    pthread_rwlock_wrlock(&cache_lock_);
+    if (*epoch_slot(key) == epoch) {
+        if (negatives_.size() >= NEGATIVE_CACHE_MAX) {
+            negatives_.clear();
+        }
+        negatives_[key] = time(NULL) + _config.negative_cache_secs_;
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+void
+DirListing::add(const struct dirent* de)
+{
+    Entry entry;
+    entry.name_ = names_.size();
+    entry.ino_  = de->d_ino;
+    entry.type_ = de->d_type;
+    names_.append(de->d_name, strlen(de->d_name) + 1);
+    entries_.push_back(entry);
+}
+
+void
+DirListing::fill(void* buf, fuse_fill_dir_t filler) const
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        st.st_ino  = entries_[i].ino_;
+        st.st_mode = entries_[i].type_ << 12;
+        if (filler(buf, names_.data() + entries_[i].name_, &st, 0))
+            break;
+    }
+}
+
+// Passes the cached listing of path to filler, returning true, or
+// else sets *epoch for the dir_cache_put of a fresh one.
+bool
+dir_cache_fill(const char* path, void* buf, fuse_fill_dir_t filler,
+               unsigned long* epoch)
+{
+    if (_config.dir_cache_secs_ == 0) {
+        return false;
+    }
+
+    std::string key(path);
+    pthread_rwlock_rdlock(&cache_lock_);
+    DirTable::const_iterator iter = listings_.find(key);
+    bool hit = iter != listings_.end() && iter->second.expires_ > time(NULL);
+    if (hit) {
+        iter->second.listing_.fill(buf, filler);
+    } else {
+        *epoch = *epoch_slot(key);
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+    return hit;
+}
+
+// Takes over the contents of listing.
+void
+dir_cache_put(const char* path, DirListing* listing, unsigned long epoch)
+{
+    if (_config.dir_cache_secs_ == 0) {
+        return;
+    }
+
+    std::string key(path);
+    pthread_rwlock_wrlock(&cache_lock_);
+    if (*epoch_slot(key) == epoch) {
+        if (listings_.size() >= DIR_CACHE_MAX) {
+            listings_.clear();
+        }
+        DirEntry& entry = listings_[key];
+        entry.listing_.names_.swap(listing->names_);
+        entry.listing_.entries_.swap(listing->entries_);
+        entry.expires_ = time(NULL) + _config.dir_cache_secs_;
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+// Called with cache_lock_ held for writing.
+static void
+drop(const std::string& path)
+{
+    ++*epoch_slot(path);
+    attrs_.erase(path);
+    negatives_.erase(path);
+    listings_.erase(path);
+}
+
+template <class Table>
+static void
+drop_under(Table* table, const std::string& prefix)
+{
+    typename Table::iterator iter = table->lower_bound(prefix);
+    while (iter != table->end() &&
+           iter->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        table->erase(iter++);
+    }
+}
+
+// Drops the cached state of path, after a change to the entry itself.
+void
+cache_invalidate(const char* path)
+{
+    if (! caching()) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&cache_lock_);
+    drop(path);
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+// Drops the cached state of path and of the directory it's in, after
+// the entry was created or removed. With tree set, everything below
+// path goes as well, as for a directory that's renamed or replaced.
+void
+cache_invalidate_entry(const char* path, bool tree)
+{
+    if (! caching()) {
+        return;
+    }
+
+    std::string key(path);
+    pthread_rwlock_wrlock(&cache_lock_);
+    drop(key);
+    drop(parent_dir(key));
+
+    if (tree) {
+        for (unsigned i = 0; i < EPOCH_SLOTS; ++i) {
+            epochs_[i]++;
+        }
+        drop_under(&attrs_, key + "/");
+        drop_under(&negatives_, key + "/");
+        drop_under(&listings_, key + "/");
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+static void
+prefetch(const PrefetchJob* job)
+{
+    std::string local_dir = DATA_DIR + job->dir_;
+    int dirfd = open(local_dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        return;
+    }
+
+    const char* name = job->names_.data();
+    const char* end  = name + job->names_.size();
+    for (; name < end; name += strlen(name) + 1) {
+        std::string path = job->dir_ + "/" + name;
+        struct stat st;
+        int err;
+        unsigned long epoch;
+        if (attr_cache_get(path.c_str(), &st, &err, &epoch)) {
+            continue;
+        }
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            attr_cache_put(path.c_str(), st, epoch);
+        }
+    }
+    close(dirfd);
+}
+
+static void*
+prefetcher(void*)
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    while (1) {
+        while (prefetch_running_ && prefetch_queue_.empty()) {
+            pthread_cond_wait(&prefetch_cv_, &prefetch_lock_);
+        }
+        if (! prefetch_running_) {
+            break;
+        }
+
+        PrefetchJob* job = prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+        pthread_mutex_unlock(&prefetch_lock_);
+
+        prefetch(job);
+        delete job;
+
+        pthread_mutex_lock(&prefetch_lock_);
+    }
+    pthread_mutex_unlock(&prefetch_lock_);
+    return NULL;
+}
+
+// Queues the entries of a directory just read for their attributes to
+// be cached, in chunks so that a large directory is spread over the
+// prefetchers. Listings are skipped while the prefetchers are behind.
+void
+prefetch_attrs(const char* path, const DirListing& listing)
+{
+    if (! prefetch_running_) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock_);
+    PrefetchJob* job = NULL;
+    for (size_t i = 0; i < listing.entries_.size(); ++i) {
+        if (prefetch_queue_.size() >= PREFETCH_QUEUE_MAX) {
+            break;
+        }
+
+        const char* name = listing.names_.data() + listing.entries_[i].name_;
+        if (! strcmp(name, ".") || ! strcmp(name, "..")) {
+            continue;
+        }
+        if (job == NULL) {
+            job = new PrefetchJob();
+            job->dir_ = path;
+            prefetch_queue_.push_back(job);
+            pthread_cond_signal(&prefetch_cv_);
+        }
+        job->names_.append(name, strlen(name) + 1);
+        if (i % PREFETCH_CHUNK == PREFETCH_CHUNK - 1) {
+            job = NULL;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock_);
+}
+
+void
+start_prefetch()
+{
+    if (_config.prefetch_threads_ == 0 || _config.attr_cache_secs_ == 0) {
+        return;
+    }
+
+    prefetch_running_ = true;
+    for (unsigned i = 0; i < _config.prefetch_threads_; ++i) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, prefetcher, NULL);
+        if (err != 0) {
+            syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+            break;
+        }
+        prefetchers_.push_back(thread);
+    }
+    if (prefetchers_.empty()) {
+        prefetch_running_ = false;
+    }
+}
+
+void
+stop_prefetch()
+{
+    if (! prefetch_running_) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock_);
+    prefetch_running_ = false;
+    pthread_cond_broadcast(&prefetch_cv_);
+    pthread_mutex_unlock(&prefetch_lock_);
+
+    for (size_t i = 0; i < prefetchers_.size(); ++i) {
+        pthread_join(prefetchers_[i], NULL);
+    }
+    prefetchers_.clear();
+
+    while (! prefetch_queue_.empty()) {
+        delete prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+    }
+}
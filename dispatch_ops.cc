@@ -32,8 +32,9 @@ dispatch(const char* path)
 //         return &config_ops;
 //     }
 
+    // extra targets of a mount aren't visible in the filesystem
     MountTable::iterator iter = _mtab.find(root);
-    if (iter != _mtab.end()) {
+    if (iter != _mtab.end() && iter->second.source_.empty()) {
         return &shadow_ops;
     }
 
@@ -59,7 +60,8 @@ static int dispatch_getattr(const char *path, struct stat *stbuf)
     int ret = do_dispatch_getattr(path, stbuf);
     if (ret >= 0) {
 //        dsyslog("getattr(%s)... OK (ret == %d)\n", path, ret);
-    } else {
+    } else if (ret != -ENOENT) {
+        // misses are routine: every compile probes its include path
         dsyslog("getattr(%s)... ERROR %s\n", path, strerror(-ret));
     }
     return ret;
@@ -679,10 +681,37 @@ static int dispatch_removexattr(const char *path, const char *name)
 }        
 #endif /* HAVE_SETXATTR */
 
+static void* dispatch_init(struct fuse_conn_info *conn)
+{
+    // Worker threads have to be started here rather than in main()
+    // since fuse_main() forks when it daemonizes.
+    start_replication();
+    start_retry();
+    start_journal();
+    start_index();
+    start_shadow_ops();
+    start_barrier();
+    start_prefetch();
+    return NULL;
+}
+
+static void dispatch_destroy(void *private_data)
+{
+    stop_prefetch();
+    stop_barrier();
+    stop_shadow_ops();
+    stop_index();
+    stop_journal();
+    stop_retry();
+    stop_replication();
+}
+
 struct fuse_operations dispatch_ops;
 void init_dispatch_ops()
 {
     memset(&dispatch_ops, 0, sizeof(dispatch_ops));
+    dispatch_ops.init		= dispatch_init;
+    dispatch_ops.destroy	= dispatch_destroy;
     dispatch_ops.getattr	= dispatch_getattr;
     dispatch_ops.access		= dispatch_access;
     dispatch_ops.readlink	= dispatch_readlink;
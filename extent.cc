@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <algorithm>
+#include <vector>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+void
+ExtentSet::add(off_t offset, off_t length)
+{
+    if (length <= 0) {
+        return;
+    }
+
+    off_t start = offset;
+    off_t end   = offset + length;
+
+    // Find the first extent that could touch the new range, which is
+    // either the one starting before it or the first one after it.
+    ExtentMap::iterator iter = extents_.upper_bound(start);
+    if (iter != extents_.begin()) {
+        ExtentMap::iterator prev = iter;
+        --prev;
+        if (prev->second >= start) {
+            iter = prev;
+        }
+    }
+
+    // Swallow every extent that overlaps or abuts [start, end)
+    while (iter != extents_.end() && iter->first <= end) {
+        start = std::min(start, iter->first);
+        end   = std::max(end, iter->second);
+        extents_.erase(iter++);
+    }
+
+    extents_[start] = end;
+}
+
+void
+ExtentSet::truncate(off_t size)
+{
+    ExtentMap::iterator iter = extents_.lower_bound(size);
+    extents_.erase(iter, extents_.end());
+
+    if (! extents_.empty()) {
+        ExtentMap::iterator last = extents_.end();
+        --last;
+        if (last->second > size) {
+            last->second = size;
+        }
+    }
+}
+
+off_t
+ExtentSet::bytes() const
+{
+    off_t total = 0;
+    ExtentMap::const_iterator iter;
+    for (iter = extents_.begin(); iter != extents_.end(); ++iter) {
+        total += iter->second - iter->first;
+    }
+    return total;
+}
+
+// Copies length bytes at offset from one file to the same offset in
+// another, stopping early at the end of the source. Where the kernel
+// can, the data is copied with copy_file_range, or failing that with
+// sendfile, so it never passes through user space. Returns the number
+// of bytes copied, or -1.
+ssize_t
+copy_range(int in_fd, int out_fd, off_t offset, off_t length)
+{
+    off_t done = 0;
+
+#ifdef __linux__
+    while (done < length) {
+        loff_t in_off  = offset + done;
+        loff_t out_off = offset + done;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off,
+                                    length - done, 0);
+        if (n == 0) {
+            return done;
+        }
+        if (n == -1) {
+            // not supported here, or between these filesystems
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                errno == EOPNOTSUPP)
+            {
+                break;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    // sendfile writes at the file position of out_fd
+    if (done < length && lseek(out_fd, offset + done, SEEK_SET) != -1) {
+        while (done < length) {
+            off_t in_off = offset + done;
+            ssize_t n = sendfile(out_fd, in_fd, &in_off,
+                                 std::min(length - done, (off_t)COPY_CHUNK));
+            if (n == 0) {
+                return done;
+            }
+            if (n == -1) {
+                if (errno == ENOSYS || errno == EINVAL) {
+                    break;
+                }
+                return -1;
+            }
+            done += n;
+        }
+    }
+#endif
+
+    std::vector<char> buf(std::min(length - done, (off_t)COPY_CHUNK));
+    while (done < length) {
+        size_t len = std::min((off_t)buf.size(), length - done);
+        ssize_t n = pread(in_fd, &buf[0], len, offset + done);
+        if (n == 0) {
+            break;
+        }
+        if (n == -1 || pwrite(out_fd, &buf[0], n, offset + done) != n) {
+            return -1;
+        }
+        done += n;
+    }
+
+    return done;
+}
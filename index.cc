@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+// The change index lets --reconcile skip the parts of a mount that
+// shadowfs hasn't modified since reconcile last checked them, instead
+// of comparing every inode on both sides.
+//
+// The daemon stamps every path it modifies with the next value of a
+// per-mount sequence number, and snapshots the resulting path -> seq
+// map to $DATA_DIR/.index/<mount> every few seconds. Once reconcile
+// has checked a path, it records the seq it saw in <mount>.verified.
+// From the two maps reconcile builds a hash tree in which every node
+// carries a hash over the changes below it and a hash over the
+// checked ones, and only descends where the two differ. Both sides
+// of the tree come from shadowfs's own records; the shadow itself is
+// never hashed, so changes made to it behind shadowfs's back are only
+// found by a --full walk.
+//
+// A snapshot records the pid of the daemon that wrote it, which is
+// cleared on a clean shutdown. If shadowfs finds its own leftover pid
+// on startup, changes since the last snapshot may be missing, so the
+// whole mount is marked changed.
+
+#define INDEX_INTERVAL 5  // seconds between snapshots
+
+// New changes are recorded in fresh_ under the mount's lock, and the
+// index writer swaps them out and merges them into changes_, which
+// only it touches. The lock is never held while a snapshot is built or
+// written, however large the index gets.
+struct MountIndex {
+    MountIndex() : seq_(0), taken_seq_(0), dirty_(false), verified_mtime_(0) {
+        pthread_mutex_init(&lock_, NULL);
+    }
+
+    std::string        root_;
+    std::string        path_;
+    ChangeMap          changes_;         // all changes not yet checked
+    ChangeMap          fresh_;           // changes since the last take
+    unsigned long long seq_;
+    unsigned long long taken_seq_;       // seq_ as of the last take
+    bool               dirty_;           // changed since the last snapshot
+    time_t             verified_mtime_;  // of the .verified file last read
+    pthread_mutex_t    lock_;            // protects fresh_ and seq_
+};
+
+typedef std::map<std::string, MountIndex*> IndexTable;
+static IndexTable indexes_;   // filled in by start_index, then fixed
+
+static pthread_mutex_t writer_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  writer_cv_   = PTHREAD_COND_INITIALIZER;
+static pthread_t       writer_;
+static bool            writer_running_ = false;
+
+static std::string
+index_path(const std::string& root)
+{
+    return DATA_DIR + "/.index/" + root;
+}
+
+// Reads an index or verified file. Returns the pid and sequence number
+// from its header, or false if it doesn't exist or is garbled.
+static bool
+read_changes(const std::string& file, ChangeMap* changes, pid_t* pid,
+             unsigned long long* seq)
+{
+    FILE* fp = fopen(file.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    char line[PATH_MAX * 3 + 64];
+    int header_pid;
+    bool ok = fgets(line, sizeof(line), fp) != NULL &&
+        sscanf(line, "shadowfs-index %d %llu", &header_pid, seq) == 2;
+    *pid = header_pid;
+
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long entry_seq;
+        char path[sizeof(line)];
+        if (sscanf(line, "%llu %s", &entry_seq, path) != 2) {
+            ok = false;
+            break;
+        }
+        (*changes)[unescape_path(path)] = entry_seq;
+    }
+    fclose(fp);
+    return ok;
+}
+
+// Writes the file under a temporary name and renames it into place,
+// so that readers always see a complete one.
+static bool
+write_changes(const std::string& file, const ChangeMap& changes, pid_t pid,
+              unsigned long long seq)
+{
+    std::string tmp_path = file + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "w");
+    if (fp == NULL) {
+        syslog(LOG_ERR, "error creating %s: %s\n", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    fprintf(fp, "shadowfs-index %d %llu\n", (int)pid, seq);
+    ChangeMap::const_iterator iter;
+    for (iter = changes.begin(); iter != changes.end(); ++iter) {
+        std::string line;
+        escape_path(&line, iter->first);
+        fprintf(fp, "%llu %s\n", iter->second, line.c_str());
+    }
+
+    bool ok = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (! ok || rename(tmp_path.c_str(), file.c_str()) != 0) {
+        syslog(LOG_ERR, "error writing %s: %s\n", file.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Drops the changes reconcile has verified since we last looked.
+static void
+prune_verified(MountIndex* mi)
+{
+    struct stat st;
+    std::string file = mi->path_ + ".verified";
+    if (stat(file.c_str(), &st) != 0 || st.st_mtime == mi->verified_mtime_) {
+        return;
+    }
+
+    ChangeMap verified;
+    pid_t pid;
+    unsigned long long seq;
+    read_changes(file, &verified, &pid, &seq);
+
+    ChangeMap::iterator iter;
+    for (iter = verified.begin(); iter != verified.end(); ++iter) {
+        ChangeMap::iterator change = mi->changes_.find(iter->first);
+        if (change != mi->changes_.end() && change->second <= iter->second) {
+            mi->changes_.erase(change);
+            mi->dirty_ = true;
+        }
+    }
+    mi->verified_mtime_ = st.st_mtime;
+}
+
+// Moves the changes recorded since the last call into changes_
+static void
+take_changes(MountIndex* mi)
+{
+    ChangeMap fresh;
+    pthread_mutex_lock(&mi->lock_);
+    fresh.swap(mi->fresh_);
+    mi->taken_seq_ = mi->seq_;
+    pthread_mutex_unlock(&mi->lock_);
+
+    ChangeMap::iterator iter;
+    for (iter = fresh.begin(); iter != fresh.end(); ++iter) {
+        mi->changes_[iter->first] = iter->second;
+    }
+    if (! fresh.empty()) {
+        mi->dirty_ = true;
+    }
+}
+
+static void
+snapshot(MountIndex* mi, pid_t pid)
+{
+    take_changes(mi);
+    if (write_changes(mi->path_, mi->changes_, pid, mi->taken_seq_)) {
+        mi->dirty_ = false;
+    }
+}
+
+static void*
+index_writer(void*)
+{
+    pthread_mutex_lock(&writer_lock_);
+    while (writer_running_) {
+        struct timespec deadline;
+        deadline.tv_sec  = time(NULL) + INDEX_INTERVAL;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&writer_cv_, &writer_lock_, &deadline);
+        pthread_mutex_unlock(&writer_lock_);
+
+        IndexTable::iterator iter;
+        for (iter = indexes_.begin(); iter != indexes_.end(); ++iter) {
+            MountIndex* mi = iter->second;
+            take_changes(mi);
+            prune_verified(mi);
+            if (mi->dirty_) {
+                snapshot(mi, getpid());
+            }
+        }
+
+        pthread_mutex_lock(&writer_lock_);
+    }
+    pthread_mutex_unlock(&writer_lock_);
+    return NULL;
+}
+
+void
+index_change(const char* path)
+{
+    if (is_local_only(path)) {
+        return;
+    }
+
+    IndexTable::iterator iter = indexes_.find(root_dir(path));
+    if (iter == indexes_.end()) {
+        return;
+    }
+
+    MountIndex* mi = iter->second;
+    pthread_mutex_lock(&mi->lock_);
+    mi->fresh_[path] = ++mi->seq_;
+    pthread_mutex_unlock(&mi->lock_);
+}
+
+void
+start_index()
+{
+    std::string dir = DATA_DIR + "/.index";
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        syslog(LOG_ERR, "error in mkdir(%s): %s\n", dir.c_str(), strerror(errno));
+    }
+
+    MountTable::iterator iter;
+    for (iter = _mtab.begin(); iter != _mtab.end(); ++iter) {
+        // changes are recorded against the mount, not its targets
+        if (! iter->second.source_.empty()) {
+            continue;
+        }
+        MountIndex* mi = new MountIndex();
+        mi->root_ = iter->first;
+        mi->path_ = index_path(iter->first);
+
+        pid_t pid = 0;
+        if (! read_changes(mi->path_, &mi->changes_, &pid, &mi->seq_) ||
+            pid != 0)
+        {
+            syslog(LOG_NOTICE, "no clean change index for %s, "
+                   "marking the whole mount changed\n", iter->first.c_str());
+            mi->changes_["/" + iter->first] = ++mi->seq_;
+        }
+
+        prune_verified(mi);
+        snapshot(mi, getpid());
+        indexes_[iter->first] = mi;
+    }
+
+    writer_running_ = true;
+    int err = pthread_create(&writer_, NULL, index_writer, NULL);
+    if (err != 0) {
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        writer_running_ = false;
+    }
+}
+
+void
+stop_index()
+{
+    if (writer_running_) {
+        pthread_mutex_lock(&writer_lock_);
+        writer_running_ = false;
+        pthread_cond_signal(&writer_cv_);
+        pthread_mutex_unlock(&writer_lock_);
+        pthread_join(writer_, NULL);
+    }
+
+    IndexTable::iterator iter;
+    for (iter = indexes_.begin(); iter != indexes_.end(); ++iter) {
+        snapshot(iter->second, 0);
+        delete iter->second;
+    }
+    indexes_.clear();
+}
+
+bool
+read_index(const std::string& root, ChangeMap* changes)
+{
+    pid_t pid;
+    unsigned long long seq;
+    if (! read_changes(index_path(root), changes, &pid, &seq)) {
+        return false;
+    }
+
+    // a snapshot left behind by a daemon that died can be missing
+    // its last few seconds of changes
+    if (pid != 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+        return false;
+    }
+    return true;
+}
+
+void
+read_verified(const std::string& root, ChangeMap* verified)
+{
+    pid_t pid;
+    unsigned long long seq;
+    read_changes(index_path(root) + ".verified", verified, &pid, &seq);
+}
+
+void
+write_verified(const std::string& root, const ChangeMap& verified)
+{
+    write_changes(index_path(root) + ".verified", verified, 0, 0);
+}
+
+IndexNode::~IndexNode()
+{
+    Children::iterator iter;
+    for (iter = children_.begin(); iter != children_.end(); ++iter) {
+        delete iter->second;
+    }
+}
+
+static unsigned long long
+mix(unsigned long long h)
+{
+    // splitmix64 finalizer
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static unsigned long long
+name_hash(const std::string& name)
+{
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < name.size(); ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Each node's hashes cover its own change and those of its children,
+// keyed by name. XOR makes the order children are visited irrelevant.
+static void
+hash_tree(IndexNode* node)
+{
+    IndexNode::Children::iterator iter;
+    for (iter = node->children_.begin(); iter != node->children_.end(); ++iter) {
+        IndexNode* child = iter->second;
+        hash_tree(child);
+        unsigned long long name = name_hash(iter->first);
+        node->local_  ^= mix(name ^ child->local_);
+        node->shadow_ ^= mix(name ^ child->shadow_);
+    }
+}
+
+void
+build_index_tree(const std::string& root, const ChangeMap& changes,
+                 const ChangeMap& verified, IndexNode* tree)
+{
+    std::string mount_path = "/" + root;
+
+    ChangeMap::const_iterator iter;
+    for (iter = changes.begin(); iter != changes.end(); ++iter) {
+        const std::string& path = iter->first;
+        if (path.compare(0, mount_path.size(), mount_path) != 0) {
+            continue;
+        }
+
+        IndexNode* node = tree;
+        size_t pos = mount_path.size();
+        while (pos < path.size()) {
+            size_t end = path.find('/', pos + 1);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            IndexNode*& child = node->children_[path.substr(pos + 1, end - pos - 1)];
+            if (child == NULL) {
+                child = new IndexNode();
+            }
+            node = child;
+            pos = end;
+        }
+
+        ChangeMap::const_iterator match = verified.find(path);
+        unsigned long long seen = match == verified.end() ? 0 : match->second;
+        node->changed_ = seen < iter->second;
+        node->local_   = mix(iter->second);
+        node->shadow_  = mix(node->changed_ ? seen : iter->second);
+    }
+
+    hash_tree(tree);
+}
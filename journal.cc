@@ -0,0 +1,752 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+// The journal for each mount lives in DATA_DIR/.journal/<mount>. It is
+// a text file with one record per line:
+//
+//     <op> <path> <path2> <a> <b> <c> <d> <checksum>
+//
+// Records are appended with a single write() on an O_APPEND fd so a
+// crash of shadowfs can't lose or tear one, and the checksum lets the
+// reader drop a partially written tail after a system crash.
+
+#define REPLAY_INTERVAL 1   // seconds between checks for work
+#define REPLAY_BATCH    256 // files copied in parallel per batch
+
+struct JournalRecord {
+    off_t       offset_;  // of the record in the journal
+    char        op_;
+    std::string path_;
+    std::string path2_;
+    long long   arg_[4];
+};
+
+// Each mount's journal is replayed by a thread of its own, so that a
+// stalled shadow only holds up its own catching up.
+struct Journal {
+    Journal() : fd_(-1), pending_(false), replayed_(0), replaying_(false) {
+        pthread_mutex_init(&lock_, NULL);
+    }
+
+    std::string     root_;
+    std::string     path_;
+    int             fd_;
+    bool            pending_;   // journal has records to replay
+    off_t           replayed_;  // offset up to which records were applied
+    pthread_mutex_t lock_;
+    pthread_t       replayer_;
+    bool            replaying_;  // replayer_ was started
+};
+
+typedef std::map<std::string, Journal*> JournalTable;
+static JournalTable journals_;
+
+static bool            replayer_running_ = false;
+static pthread_mutex_t replayer_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  replayer_cv_   = PTHREAD_COND_INITIALIZER;
+
+static unsigned int
+checksum(const char* buf, size_t len)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// Escapes whitespace and % in a path so it can be stored as one
+// field of a line.
+void
+escape_path(std::string* out, const std::string& s)
+{
+    if (s.empty()) {
+        out->append("%");
+        return;
+    }
+    
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c == '%' || c <= ' ' || c == 0x7f) {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02x", c);
+            out->append(hex);
+        } else {
+            out->push_back(c);
+        }
+    }
+}
+
+std::string
+unescape_path(const std::string& s)
+{
+    std::string out;
+    if (s == "%") {
+        return out;
+    }
+    
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '%' && i + 2 < s.size()) {
+            out.push_back((char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16));
+            i += 2;
+        } else {
+            out.push_back(s[i]);
+        }
+    }
+    return out;
+}
+
+static Journal*
+find_journal(const std::string& root)
+{
+    JournalTable::iterator iter = journals_.find(root);
+    if (iter == journals_.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+bool
+journal_pending(const char* path)
+{
+    Journal* j = find_journal(root_dir(path));
+    if (j == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&j->lock_);
+    bool pending = j->pending_;
+    pthread_mutex_unlock(&j->lock_);
+    return pending;
+}
+
+// Returns true if the shadow side of an operation on path has to be
+// skipped, either because the path is local-only or because the
+// shadow is offline or still replaying its journal. The caller is
+// expected to journal the skipped op.
+bool
+shadow_offline(const char* path)
+{
+    return is_offline(path) || journal_pending(path);
+}
+
+void
+journal_record(JournalOp op, const char* path, const char* path2,
+               long long a, long long b, long long c, long long d)
+{
+    // Local-only paths are never replicated, so there is nothing to
+    // catch up on later.
+    if (is_local_only(path)) {
+        return;
+    }
+
+    Journal* j = find_journal(root_dir(path));
+    if (j == NULL || j->fd_ == -1) {
+        syslog(LOG_ERR, "no journal for %s: %c not recorded\n", path, op);
+        return;
+    }
+
+    std::string line;
+    line.push_back((char)op);
+    line.push_back(' ');
+    escape_path(&line, path);
+    line.push_back(' ');
+    escape_path(&line, path2);
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), " %lld %lld %lld %lld", a, b, c, d);
+    line.append(buf);
+    snprintf(buf, sizeof(buf), " %08x\n", checksum(line.data(), line.size()));
+    line.append(buf);
+
+    pthread_mutex_lock(&j->lock_);
+    if (write(j->fd_, line.data(), line.size()) != (ssize_t)line.size()) {
+        syslog(LOG_ERR, "error writing journal %s: %s\n",
+               j->path_.c_str(), strerror(errno));
+    }
+    j->pending_ = true;
+    pthread_mutex_unlock(&j->lock_);
+
+    dsyslog("journal: %s", line.c_str());
+}
+
+void
+journal_sync(const char* path)
+{
+    Journal* j = find_journal(root_dir(path));
+    if (j != NULL && j->fd_ != -1 && fdatasync(j->fd_) != 0) {
+        syslog(LOG_ERR, "error syncing journal %s: %s\n",
+               j->path_.c_str(), strerror(errno));
+    }
+}
+
+// Records the effect of opening path on the shadow
+void
+journal_open(const char* path, int flags, mode_t mode, bool create,
+             uid_t uid, gid_t gid)
+{
+    if (create) {
+        journal_record(J_MKNOD, path, "", S_IFREG | mode, 0, uid, gid);
+    } else if (flags & O_TRUNC) {
+        journal_record(J_TRUNCATE, path, "", 0);
+    }
+}
+
+static bool
+parse_record(const std::string& line, JournalRecord* rec)
+{
+    size_t sum_pos = line.rfind(' ');
+    if (sum_pos == std::string::npos) {
+        return false;
+    }
+
+    unsigned int sum = strtoul(line.c_str() + sum_pos + 1, NULL, 16);
+    if (sum != checksum(line.data(), sum_pos)) {
+        return false;
+    }
+
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (start < sum_pos) {
+        size_t end = line.find(' ', start);
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+
+    if (fields.size() != 7 || fields[0].size() != 1) {
+        return false;
+    }
+
+    rec->op_    = fields[0][0];
+    rec->path_  = unescape_path(fields[1]);
+    rec->path2_ = unescape_path(fields[2]);
+    for (int i = 0; i < 4; ++i) {
+        rec->arg_[i] = strtoll(fields[3 + i].c_str(), NULL, 10);
+    }
+    return true;
+}
+
+// Read all complete records from the given offset, returning the
+// offset just past the last one that was read.
+static off_t
+read_records(Journal* j, off_t offset, std::vector<JournalRecord>* recs)
+{
+    std::string data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = pread(j->fd_, buf, sizeof(buf), offset + data.size())) > 0) {
+        data.append(buf, n);
+    }
+
+    size_t start = 0;
+    size_t nl;
+    while ((nl = data.find('\n', start)) != std::string::npos) {
+        JournalRecord rec;
+        rec.offset_ = offset + start;
+        if (! parse_record(data.substr(start, nl - start), &rec)) {
+            syslog(LOG_ERR, "corrupt record in journal %s at offset %llu\n",
+                   j->path_.c_str(),
+                   static_cast<unsigned long long>(offset + start));
+        } else {
+            recs->push_back(rec);
+        }
+        start = nl + 1;
+    }
+
+    return offset + start;
+}
+
+// Copies the dirty ranges of a file from the local copy to the shadow
+// and then brings the shadow's timestamps in line with the local ones.
+// A copy that fails because the shadow can't be reached bumps
+// *failures, so the replay knows not to move past the writes; other
+// errors would only fail again, so the file is left to reconcile.
+struct CopyRangesOp : public ShadowOp {
+    CopyRangesOp(const std::string& path, const ExtentSet& dirty, int* failures)
+        : ShadowOp(path), dirty_(dirty), failures_(failures) {}
+
+    off_t traffic() const { return dirty_.bytes(); }
+
+    void fail(int err) {
+        if (is_offline(path_.c_str()) || is_transport_error(err)) {
+            __sync_add_and_fetch(failures_, 1);
+        } else {
+            index_change(path_.c_str());
+        }
+    }
+
+    void apply() {
+        std::string local_path  = get_local_path(path_.c_str());
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        if (is_offline(path_.c_str())) {
+            __sync_add_and_fetch(failures_, 1);
+            return;
+        }
+
+        struct stat st;
+        int local_fd = open(local_path.c_str(), O_RDONLY);
+        if (local_fd == -1 || fstat(local_fd, &st) != 0) {
+            // the file must have been removed since, which will be
+            // reflected in a later record
+            dsyslog("replay: can't open %s: %s\n",
+                    local_path.c_str(), strerror(errno));
+            if (local_fd != -1) {
+                close(local_fd);
+            }
+            return;
+        }
+
+        int shadow_fd = SHADOW_CALL(path_.c_str(),
+                                    open(shadow_path.c_str(), O_WRONLY | O_CREAT,
+                                         st.st_mode & 07777));
+        if (shadow_fd == -1) {
+            int err = errno;
+            syslog(LOG_ERR, "error in replay open(%s): %s\n",
+                   shadow_path.c_str(), strerror(err));
+            close(local_fd);
+            fail(err);
+            return;
+        }
+
+        ExtentSet::ExtentMap::const_iterator iter;
+        for (iter = dirty_.extents_.begin(); iter != dirty_.extents_.end(); ++iter) {
+            off_t end = std::min(iter->second, st.st_size);
+            if (end <= iter->first) {
+                continue;
+            }
+            off_t length = end - iter->first;
+            throttle(path_.c_str(), length, 0);
+            if (SHADOW_COPY(path_.c_str(), length,
+                            copy_range(local_fd, shadow_fd, iter->first, length)) == -1)
+            {
+                int err = errno;
+                syslog(LOG_ERR, "error in replay write(%s): %s\n",
+                       shadow_path.c_str(), strerror(err));
+                close(shadow_fd);
+                close(local_fd);
+                fail(err);
+                return;
+            }
+        }
+
+        struct timeval tv[2];
+        tv[0].tv_sec  = st.st_atime;
+        tv[0].tv_usec = 0;
+        tv[1].tv_sec  = st.st_mtime;
+        tv[1].tv_usec = 0;
+        futimes(shadow_fd, tv);
+
+        close(shadow_fd);
+        close(local_fd);
+    }
+
+    ExtentSet dirty_;
+    int*      failures_;
+};
+
+typedef std::map<std::string, ExtentSet> DirtyTable;
+
+static void
+rename_dirty(DirtyTable* dirty, const std::string& from, const std::string& to)
+{
+    std::string prefix = from + "/";
+    DirtyTable::iterator iter = dirty->lower_bound(from);
+    while (iter != dirty->end()) {
+        const std::string& path = iter->first;
+        std::string newpath;
+        if (path == from) {
+            newpath = to;
+        } else if (path.compare(0, prefix.size(), prefix) == 0) {
+            newpath = to + path.substr(from.size());
+        } else if (path > prefix) {
+            break;
+        } else {
+            ++iter;
+            continue;
+        }
+        (*dirty)[newpath] = iter->second;
+        dirty->erase(iter++);
+    }
+}
+
+// Keeps the dirty ranges in step with what rec does to file data
+static void
+track_dirty(const JournalRecord& rec, DirtyTable* dirty)
+{
+    const long long* a = rec.arg_;
+
+    switch (rec.op_) {
+    case J_WRITE:
+        (*dirty)[rec.path_].add(a[0], a[1]);
+        break;
+
+    case J_TRUNCATE:
+        (*dirty)[rec.path_].truncate(a[0]);
+        break;
+
+    case J_UNLINK:
+        dirty->erase(rec.path_);
+        break;
+
+    case J_RENAME:
+        rename_dirty(dirty, rec.path_, rec.path2_);
+        break;
+    }
+}
+
+// Applies a namespace or attribute record to the shadow
+static int
+replay_call(const JournalRecord& rec)
+{
+    const char* path = rec.path_.c_str();
+    std::string shadow_path = get_shadow_path(path);
+    const char* sp = shadow_path.c_str();
+    const long long* a = rec.arg_;
+    int res = 0;
+
+    switch (rec.op_) {
+    case J_TRUNCATE:
+        res = truncate(sp, a[0]);
+        break;
+
+    case J_MKNOD:
+        if (S_ISREG(a[0])) {
+            res = open(sp, O_CREAT | O_EXCL | O_WRONLY, (mode_t)a[0]);
+            if (res >= 0)
+                res = close(res);
+        } else if (S_ISFIFO(a[0])) {
+            res = mkfifo(sp, a[0]);
+        } else {
+            res = mknod(sp, a[0], a[1]);
+        }
+        if (res == 0)
+            chown(sp, a[2], a[3]);
+        break;
+
+    case J_MKDIR:
+        res = mkdir(sp, a[0]);
+        if (res == 0)
+            chown(sp, a[1], a[2]);
+        break;
+
+    case J_UNLINK:
+        res = unlink(sp);
+        break;
+
+    case J_RMDIR:
+        res = rmdir(sp);
+        break;
+
+    case J_SYMLINK:
+        res = symlink(rec.path2_.c_str(), sp);
+        if (res == 0)
+            lchown(sp, a[0], a[1]);
+        break;
+
+    case J_RENAME:
+        res = rename(sp, get_shadow_path(rec.path2_.c_str()).c_str());
+        break;
+
+    case J_LINK: {
+        std::string shadow_to = get_shadow_path(rec.path2_.c_str());
+        res = link(sp, shadow_to.c_str());
+        if (res == 0)
+            chown(shadow_to.c_str(), a[0], a[1]);
+        break;
+    }
+
+    case J_CHMOD:
+        res = chmod(sp, a[0]);
+        break;
+
+    case J_CHOWN:
+        res = lchown(sp, a[0], a[1]);
+        break;
+
+    case J_UTIMENS: {
+        struct timeval tv[2];
+        tv[0].tv_sec  = a[0];
+        tv[0].tv_usec = a[1] / 1000;
+        tv[1].tv_sec  = a[2];
+        tv[1].tv_usec = a[3] / 1000;
+        res = utimes(sp, tv);
+        break;
+    }
+
+#ifdef HAVE_SETXATTR
+    case J_XATTR: {
+        // copy the current value from the local file, or remove it
+        // from the shadow if it's gone
+        std::string local_path = get_local_path(path);
+        const char* name = rec.path2_.c_str();
+        char value[65536];
+        ssize_t len = lgetxattr(local_path.c_str(), name, value, sizeof(value));
+        if (len >= 0) {
+            res = lsetxattr(sp, name, value, len, 0);
+        } else {
+            res = lremovexattr(sp, name);
+        }
+        break;
+    }
+#endif
+
+    default:
+        syslog(LOG_ERR, "replay: unknown journal op %c for %s\n", rec.op_, path);
+        return 0;
+    }
+
+    // Replaying a record that was already applied before a crash or
+    // an interrupted replay is harmless, so don't complain about it.
+    if (res == -1 && errno != EEXIST && errno != ENOENT) {
+        int err = errno;
+        syslog(LOG_ERR, "error in replay %c(%s): %s\n",
+               rec.op_, sp, strerror(err));
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Replays one record on the mount's replication workers, so that it
+// counts towards the mount's health, and the replayer waits for it no
+// longer than deadline_ms before the mount is taken offline.
+struct ReplayOp : public ShadowOp {
+    ReplayOp(const JournalRecord& rec)
+        : ShadowOp(rec.path_), rec_(rec), res_(0), err_(0) {}
+
+    void apply() {
+        res_ = SHADOW_CALL(path_.c_str(), replay_call(rec_));
+        err_ = errno;
+    }
+
+    JournalRecord rec_;
+    int           res_;
+    int           err_;
+};
+
+// Copies the dirty ranges to the shadow, returning false if any of
+// them couldn't be copied because the shadow went away.
+static bool
+copy_dirty(DirtyTable* dirty)
+{
+    int failures = 0;
+    std::vector<std::string> batch;
+    DirtyTable::iterator iter = dirty->begin();
+    while (iter != dirty->end()) {
+        if (! iter->second.empty()) {
+            replicate_op(new CopyRangesOp(iter->first, iter->second, &failures));
+            batch.push_back(iter->first);
+        }
+        ++iter;
+
+        if (batch.size() == REPLAY_BATCH || iter == dirty->end()) {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                replicate_flush(batch[i]);
+            }
+            batch.clear();
+        }
+    }
+    return __sync_add_and_fetch(&failures, 0) == 0;
+}
+
+static void
+replay_journal(const std::string& root, Journal* j)
+{
+    std::string mount_path = "/" + root;
+    
+    while (1) {
+        std::vector<JournalRecord> recs;
+        off_t end = read_records(j, j->replayed_, &recs);
+
+        if (recs.empty()) {
+            // Only declare the journal done if nothing was appended
+            // while we were replaying the last batch.
+            pthread_mutex_lock(&j->lock_);
+            struct stat st;
+            if (fstat(j->fd_, &st) == 0 && st.st_size == end) {
+                if (ftruncate(j->fd_, 0) != 0) {
+                    syslog(LOG_ERR, "error truncating journal %s: %s\n",
+                           j->path_.c_str(), strerror(errno));
+                }
+                j->replayed_ = 0;
+                j->pending_ = false;
+                syslog(LOG_NOTICE, "journal replay for %s complete\n",
+                       root.c_str());
+            }
+            pthread_mutex_unlock(&j->lock_);
+            return;
+        }
+
+        syslog(LOG_NOTICE, "replaying %zu journal records for %s\n",
+               recs.size(), root.c_str());
+
+        // Namespace and attribute changes are applied in order. Writes
+        // only mark ranges dirty, and the data is copied in parallel
+        // from the current local contents once the namespace is in
+        // shape.
+        //
+        // Replay stops at the first record that fails because the
+        // shadow went away, and resumes from there. A record the
+        // server rejects outright would only fail again, so it's
+        // passed over and its path left for reconcile to check.
+        DirtyTable dirty;
+        size_t done = 0;
+        for (; done < recs.size(); ++done) {
+            const JournalRecord& rec = recs[done];
+            if (is_offline(mount_path.c_str())) {
+                break;
+            }
+            if (rec.op_ != J_WRITE) {
+                ReplayOp* op = new ReplayOp(rec);
+                if (! replicate_wait(op)) {
+                    break; // timed out, and the mount is offline now
+                }
+                int res = op->res_;
+                int err = op->err_;
+                delete op;
+
+                if (res != 0) {
+                    if (is_offline(mount_path.c_str()) || is_transport_error(err)) {
+                        break;
+                    }
+                    index_change(rec.path_.c_str());
+                }
+            }
+            track_dirty(rec, &dirty);
+        }
+
+        // Nothing is marked replayed until the data of the writes
+        // before that point is on the shadow too; replaying the
+        // namespace records again is harmless.
+        if (! copy_dirty(&dirty)) {
+            syslog(LOG_NOTICE, "journal replay for %s interrupted\n",
+                   root.c_str());
+            return;
+        }
+        if (done < recs.size()) {
+            j->replayed_ = recs[done].offset_;
+            syslog(LOG_NOTICE, "journal replay for %s interrupted\n",
+                   root.c_str());
+            return;
+        }
+        j->replayed_ = end;
+    }
+}
+
+static void*
+replayer(void* arg)
+{
+    Journal* j = (Journal*)arg;
+    std::string mount_path = "/" + j->root_;
+
+    pthread_mutex_lock(&replayer_lock_);
+    while (replayer_running_) {
+        struct timespec deadline;
+        deadline.tv_sec  = time(NULL) + REPLAY_INTERVAL;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&replayer_cv_, &replayer_lock_, &deadline);
+        pthread_mutex_unlock(&replayer_lock_);
+
+        if (journal_pending(mount_path.c_str()) &&
+            ! is_offline(mount_path.c_str()))
+        {
+            replay_journal(j->root_, j);
+        }
+
+        pthread_mutex_lock(&replayer_lock_);
+    }
+    pthread_mutex_unlock(&replayer_lock_);
+    return NULL;
+}
+
+void
+start_journal()
+{
+    std::string dir = DATA_DIR + "/.journal";
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        syslog(LOG_ERR, "error in mkdir(%s): %s\n", dir.c_str(), strerror(errno));
+    }
+
+    MountTable::iterator iter;
+    for (iter = _mtab.begin(); iter != _mtab.end(); ++iter) {
+        Journal* j = new Journal();
+        j->root_ = iter->first;
+        j->path_ = dir + "/" + iter->first;
+        j->fd_ = open(j->path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (j->fd_ == -1) {
+            syslog(LOG_ERR, "error opening journal %s: %s\n",
+                   j->path_.c_str(), strerror(errno));
+        } else {
+            // pick up anything left over from a previous run
+            struct stat st;
+            if (fstat(j->fd_, &st) == 0 && st.st_size != 0) {
+                syslog(LOG_NOTICE, "journal %s has pending records\n",
+                       j->path_.c_str());
+                j->pending_ = true;
+            }
+        }
+        journals_[iter->first] = j;
+    }
+
+    replayer_running_ = true;
+    JournalTable::iterator jiter;
+    for (jiter = journals_.begin(); jiter != journals_.end(); ++jiter) {
+        Journal* j = jiter->second;
+        int err = pthread_create(&j->replayer_, NULL, replayer, j);
+        if (err != 0) {
+            syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        } else {
+            j->replaying_ = true;
+        }
+    }
+}
+
+void
+stop_journal()
+{
+    pthread_mutex_lock(&replayer_lock_);
+    replayer_running_ = false;
+    pthread_cond_broadcast(&replayer_cv_);
+    pthread_mutex_unlock(&replayer_lock_);
+
+    JournalTable::iterator iter;
+    for (iter = journals_.begin(); iter != journals_.end(); ++iter) {
+        if (iter->second->replaying_) {
+            pthread_join(iter->second->replayer_, NULL);
+        }
+    }
+
+    for (iter = journals_.begin(); iter != journals_.end(); ++iter) {
+        if (iter->second->fd_ != -1) {
+            fdatasync(iter->second->fd_);
+            close(iter->second->fd_);
+        }
+        delete iter->second;
+    }
+    journals_.clear();
+}
@@ -24,10 +24,13 @@
 
 MountTable _mtab;
 std::string DATA_DIR;
+ShadowConfig _config;
 int debug = 0;
 
 extern struct fuse_lowlevel_ops shadow_ll_ops;
 extern void init_shadow_ll_ops();
+extern void start_ll_watcher(struct fuse_chan* ch);
+extern void stop_ll_watcher();
 
 int
 read_mounts()
@@ -49,6 +52,10 @@ read_mounts()
         if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
             continue;
 
+        // extra targets of a mount are only replicated by shadowfs
+        if (strchr(de->d_name, '@') != NULL)
+            continue;
+
         if (de->d_type != DT_LNK) {
             syslog(LOG_ERR, "bad file in config directory: %s not a link\n",
                     de->d_name);
@@ -66,6 +73,8 @@ read_mounts()
         
         syslog(LOG_NOTICE, "initializing mount %s -> %s\n", de->d_name, link_target);
         _mtab[de->d_name] = MountInfo(link_target);
+        load_local_only(&_mtab[de->d_name],
+                        DATA_DIR + ".localonly/" + de->d_name);
     }
 
     closedir(dp);
@@ -118,7 +127,9 @@ int main(int argc, char *argv[])
         if (se != NULL) {
             if (fuse_set_signal_handlers(se) != -1) {
                 fuse_session_add_chan(se, ch);
+                start_ll_watcher(ch);
                 err = fuse_session_loop(se);
+                stop_ll_watcher();
                 fuse_remove_signal_handlers(se);
                 fuse_session_remove_chan(ch);
             }
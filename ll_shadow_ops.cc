@@ -22,23 +22,37 @@
 #include <dirent.h>
 #include <fuse/fuse_lowlevel.h>
 #include <map>
+#include <pthread.h>
 #include <vector>
+#ifdef linux
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
-#define ATTR_TIMEOUT 5
+// ll_shadowfs is the only writer to DATA_DIR, so the kernel can keep
+// entries, attributes and file contents for a long time. Changes made
+// behind its back are caught by inotify and invalidated explicitly
+// (see the watcher below).
+#define ATTR_TIMEOUT 3600
+#define NEGATIVE_TIMEOUT 3600
+#define PREFETCH_SECS 1
+#define PREFETCH_MAX 4096
 
 #define OPEN_DIRECT_IO false
-#define OPEN_KEEP_CACHE false
+#define OPEN_KEEP_CACHE true
 
 typedef std::vector<std::string> LinkVector;
 struct ShadowInodeState {
     ShadowInodeState(const std::string& path)
-        : path_(path), local_fd_(0), shadow_fd_(0), offline_(false) {}
+        : path_(path), local_fd_(0), shadow_fd_(0), offline_(false),
+          watched_(false) {}
 
     std::string path_;
     LinkVector links_;
     int local_fd_;
     int shadow_fd_;
     bool offline_;
+    bool watched_;  // a directory with an inotify watch
     struct stat attr;
 };
 
@@ -59,6 +73,469 @@ InodeMap inode_map_;
 typedef std::map<std::string, ShadowInodeState*> PathMap;
 PathMap path_map_;
 
+// The FUSE 2 lowlevel API has no readdirplus, so readdir stats its
+// entries in the same pass and keeps the results briefly for the
+// lookups that usually follow. Each is used once, and all are dropped
+// by any change to the tree. Changes made by others drop those of the
+// names they touch, from the watcher thread (see watch_event), and an
+// entry stat'ed before such a change but stored after it is discarded
+// by the generation check in put_prefetched.
+struct PrefetchedAttr {
+    struct stat attr;
+    time_t when;
+    unsigned long gen;  // prefetch_gen_ before the stat
+};
+typedef std::map<std::string, PrefetchedAttr> PrefetchMap;
+static PrefetchMap prefetched_;
+static unsigned long prefetch_gen_ = 0;  // bumped by every drop
+static pthread_mutex_t prefetch_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long
+prefetch_gen()
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    unsigned long gen = prefetch_gen_;
+    pthread_mutex_unlock(&prefetch_lock_);
+    return gen;
+}
+
+static bool
+take_prefetched(const std::string& path, struct stat* attr)
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    PrefetchMap::iterator iter = prefetched_.find(path);
+    bool fresh = false;
+    if (iter != prefetched_.end()) {
+        fresh = iter->second.when + PREFETCH_SECS >= time(NULL);
+        if (fresh) {
+            *attr = iter->second.attr;
+        }
+        prefetched_.erase(iter);
+    }
+    pthread_mutex_unlock(&prefetch_lock_);
+    return fresh;
+}
+
+static void
+put_prefetched(const std::string& path, const PrefetchedAttr& pre)
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    if (pre.gen == prefetch_gen_) {
+        if (prefetched_.size() >= PREFETCH_MAX) {
+            prefetched_.clear();
+        }
+        prefetched_[path] = pre;
+    }
+    pthread_mutex_unlock(&prefetch_lock_);
+}
+
+// Drops what was prefetched for path and, if it's a directory that was
+// moved or removed, for the names below it
+static void
+drop_prefetched(const std::string& path)
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    prefetch_gen_++;
+    PrefetchMap::iterator iter = prefetched_.lower_bound(path);
+    while (iter != prefetched_.end() &&
+           iter->first.compare(0, path.size(), path) == 0)
+    {
+        if (iter->first.size() == path.size() ||
+            iter->first[path.size()] == '/')
+        {
+            prefetched_.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock_);
+}
+
+static void
+forget_prefetched()
+{
+    pthread_mutex_lock(&prefetch_lock_);
+    prefetch_gen_++;
+    prefetched_.clear();
+    pthread_mutex_unlock(&prefetch_lock_);
+}
+
+// Every directory the kernel knows of is watched, so that whoever else
+// changes DATA_DIR (a reconcile, a tool run directly against the data,
+// an edit on the local disk) has the kernel's copies of the affected
+// entries and inodes dropped. Our own changes show up as well, and are
+// matched against the events they cause so that they don't flush the
+// cache we're filling, while a change someone else makes right after
+// one of ours still gets through:
+//
+// - each name we create, remove or rename away or onto expects exactly
+//   one event, and counts it off when it arrives;
+// - inode events can't be counted, since inotify folds repeated ones
+//   together, so the ctime our last change left the inode with is kept
+//   instead. An event for the inode is ours while that's still its
+//   ctime, or while one of our changes to it is under way.
+//
+// Directories that can't be watched (inotify missing, or out of
+// watches) fall back to short timeouts, see cache_timeout.
+#define OWN_CHANGE_MAX 4096
+#define UNWATCHED_TIMEOUT 5
+
+struct WatchedDir {
+    fuse_ino_t  ino_;
+    std::string local_path_;
+};
+typedef std::map<int, WatchedDir> WatchMap;
+
+struct OwnInode {
+    OwnInode() : pending_(0), ctime_(0), ctime_nsec_(0) {}
+    int    pending_;     // our changes to the inode under way
+    time_t ctime_;       // the inode's ctime after the last of them
+    long   ctime_nsec_;
+};
+
+static WatchMap                    watches_;
+static std::map<fuse_ino_t, OwnInode> own_changes_;
+static std::map<std::string, int>  own_entries_;  // events still expected
+static pthread_mutex_t             watch_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_chan*           watch_chan_ = NULL;
+static pthread_t                   watcher_;
+static bool                        watcher_running_ = false;
+static int                         inotify_fd_ = -1;
+static uint32_t                    moved_cookie_ = 0;
+static std::string                 moved_from_;
+
+static void
+watch_dir(ShadowInodeState* state)
+{
+#ifdef linux
+    if (inotify_fd_ == -1) {
+        return;
+    }
+
+    std::string local_path = DATA_DIR + state->path_;
+    if (local_path[local_path.size() - 1] == '/') {
+        local_path.erase(local_path.size() - 1);
+    }
+    int wd = inotify_add_watch(inotify_fd_, local_path.c_str(),
+                               IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                               IN_CREATE | IN_DELETE |
+                               IN_MOVED_FROM | IN_MOVED_TO);
+    if (wd == -1) {
+        dsyslog("watch_dir(%s): %s\n", local_path.c_str(), strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock_);
+    WatchedDir& dir = watches_[wd];
+    dir.ino_        = state->attr.st_ino;
+    dir.local_path_ = local_path;
+    pthread_mutex_unlock(&watch_lock_);
+    state->watched_ = true;
+#endif
+}
+
+static void
+unwatch_dir(ShadowInodeState* state)
+{
+#ifdef linux
+    if (inotify_fd_ == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock_);
+    WatchMap::iterator iter;
+    for (iter = watches_.begin(); iter != watches_.end(); ++iter) {
+        if (iter->second.ino_ == state->attr.st_ino) {
+            inotify_rm_watch(inotify_fd_, iter->first);
+            watches_.erase(iter);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock_);
+#endif
+}
+
+static long
+ctime_nsec(const struct stat& st)
+{
+#ifdef __APPLE__
+    return st.st_ctimespec.tv_nsec;
+#else
+    return st.st_ctim.tv_nsec;
+#endif
+}
+
+// Marks a change we're making to an inode, from construction to the
+// end of the scope, when the ctime it left behind is taken from fd or
+// the local path.
+class OwnChange {
+public:
+    OwnChange(fuse_ino_t ino, const std::string& local_path, int fd = -1)
+        : ino_(ino), local_path_(local_path), fd_(fd)
+    {
+        pthread_mutex_lock(&watch_lock_);
+        if (own_changes_.size() >= OWN_CHANGE_MAX) {
+            own_changes_.clear();
+        }
+        own_changes_[ino_].pending_++;
+        pthread_mutex_unlock(&watch_lock_);
+    }
+
+    ~OwnChange()
+    {
+        struct stat st;
+        int res = fd_ != -1 ? fstat(fd_, &st) : lstat(local_path_.c_str(), &st);
+
+        pthread_mutex_lock(&watch_lock_);
+        OwnInode& own = own_changes_[ino_];
+        if (own.pending_ > 0) {
+            own.pending_--;
+        }
+        if (res == 0) {
+            own.ctime_      = st.st_ctime;
+            own.ctime_nsec_ = ctime_nsec(st);
+        }
+        pthread_mutex_unlock(&watch_lock_);
+    }
+
+private:
+    fuse_ino_t  ino_;
+    std::string local_path_;
+    int         fd_;
+};
+
+// Marks names we're about to add or remove, each of which then expects
+// one event. Unless done() is called, the change is taken to have
+// failed when the scope ends and the expected events are dropped.
+class OwnEntries {
+public:
+    OwnEntries(const std::string& path, const std::string& path2 = "")
+        : done_(false)
+    {
+        paths_[0] = DATA_DIR + path;
+        paths_[1] = path2.empty() ? "" : DATA_DIR + path2;
+
+        pthread_mutex_lock(&watch_lock_);
+        if (own_entries_.size() >= OWN_CHANGE_MAX) {
+            own_entries_.clear();
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (! paths_[i].empty()) {
+                own_entries_[paths_[i]]++;
+            }
+        }
+        pthread_mutex_unlock(&watch_lock_);
+    }
+
+    ~OwnEntries()
+    {
+        if (done_) {
+            return;
+        }
+
+        pthread_mutex_lock(&watch_lock_);
+        for (int i = 0; i < 2; ++i) {
+            std::map<std::string, int>::iterator iter =
+                own_entries_.find(paths_[i]);
+            if (iter != own_entries_.end() && --iter->second <= 0) {
+                own_entries_.erase(iter);
+            }
+        }
+        pthread_mutex_unlock(&watch_lock_);
+    }
+
+    void done() { done_ = true; }
+
+private:
+    std::string paths_[2];
+    bool        done_;
+};
+
+// Returns true if the event for the name at local_path is one we
+// expected. Called with watch_lock_ held.
+static bool
+own_entry_event(const std::string& local_path)
+{
+    std::map<std::string, int>::iterator iter = own_entries_.find(local_path);
+    if (iter == own_entries_.end()) {
+        return false;
+    }
+    if (--iter->second <= 0) {
+        own_entries_.erase(iter);
+    }
+    return true;
+}
+
+// Returns true if the inode with the given attributes was last changed
+// by us. Called with watch_lock_ held.
+static bool
+own_inode_event(const struct stat& st)
+{
+    std::map<fuse_ino_t, OwnInode>::iterator iter = own_changes_.find(st.st_ino);
+    if (iter == own_changes_.end()) {
+        return false;
+    }
+    const OwnInode& own = iter->second;
+    if (own.pending_ > 0 ||
+        (own.ctime_ == st.st_ctime && own.ctime_nsec_ == ctime_nsec(st)))
+    {
+        return true;
+    }
+    own_changes_.erase(iter);
+    return false;
+}
+
+#ifdef linux
+// Keeps the paths of watched directories current when one of them, or
+// a directory above it, is renamed by us or anyone else. The two
+// halves of a rename share a cookie and arrive in order with the
+// events for the directory's contents, so the events that follow find
+// the new paths. Called with watch_lock_ held.
+static void
+move_watches(const struct inotify_event* ev, const std::string& local_path)
+{
+    if (ev->mask & IN_MOVED_FROM) {
+        moved_cookie_ = ev->cookie;
+        moved_from_   = local_path;
+        return;
+    }
+    if (! (ev->mask & IN_MOVED_TO) || ev->cookie != moved_cookie_ ||
+        moved_from_.empty())
+    {
+        return;
+    }
+
+    WatchMap::iterator iter;
+    for (iter = watches_.begin(); iter != watches_.end(); ++iter) {
+        std::string& path = iter->second.local_path_;
+        if (path.compare(0, moved_from_.size(), moved_from_) == 0 &&
+            (path.size() == moved_from_.size() || path[moved_from_.size()] == '/'))
+        {
+            dsyslog("watcher: %s moved to %s\n", path.c_str(), local_path.c_str());
+            path = local_path + path.substr(moved_from_.size());
+        }
+    }
+    moved_from_.clear();
+}
+
+static void
+watch_event(const struct inotify_event* ev)
+{
+    if (ev->len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock_);
+    WatchMap::const_iterator iter = watches_.find(ev->wd);
+    if (iter == watches_.end()) {
+        pthread_mutex_unlock(&watch_lock_);
+        return;
+    }
+    fuse_ino_t parent = iter->second.ino_;
+    std::string local_path = iter->second.local_path_ + "/" + ev->name;
+
+    // prefetched attributes are keyed by path below DATA_DIR
+    if (local_path.compare(0, DATA_DIR.size(), DATA_DIR) == 0) {
+        drop_prefetched(local_path.substr(DATA_DIR.size()));
+    }
+
+    if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        if (ev->mask & IN_ISDIR) {
+            move_watches(ev, local_path);
+        }
+        bool own = own_entry_event(local_path);
+        pthread_mutex_unlock(&watch_lock_);
+        if (! own) {
+            dsyslog("watcher: %s added or removed\n", local_path.c_str());
+            fuse_lowlevel_notify_inval_entry(watch_chan_, parent,
+                                             ev->name, strlen(ev->name));
+        }
+        return;
+    }
+    pthread_mutex_unlock(&watch_lock_);
+
+    struct stat st;
+    if (lstat(local_path.c_str(), &st) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock_);
+    bool own = own_inode_event(st);
+    pthread_mutex_unlock(&watch_lock_);
+
+    if (! own) {
+        dsyslog("watcher: %s changed\n", local_path.c_str());
+        fuse_lowlevel_notify_inval_inode(watch_chan_, st.st_ino, 0, 0);
+    }
+}
+
+static void*
+watcher(void*)
+{
+    char buf[64 * 1024]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    // polled so that stop_ll_watcher is noticed within a second
+    while (watcher_running_) {
+        struct pollfd pfd;
+        pfd.fd     = inotify_fd_;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        const struct inotify_event* ev;
+        for (char* p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            watch_event(ev);
+        }
+    }
+    return NULL;
+}
+#endif
+
+void
+start_ll_watcher(struct fuse_chan* ch)
+{
+#ifdef linux
+    inotify_fd_ = inotify_init();
+    if (inotify_fd_ == -1) {
+        syslog(LOG_ERR, "error in inotify_init: %s\n", strerror(errno));
+        return;
+    }
+
+    watch_chan_ = ch;
+    watcher_running_ = true;
+    int err = pthread_create(&watcher_, NULL, watcher, NULL);
+    if (err != 0) {
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        watcher_running_ = false;
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+    }
+#endif
+}
+
+void
+stop_ll_watcher()
+{
+#ifdef linux
+    if (! watcher_running_) {
+        return;
+    }
+
+    watcher_running_ = false;
+    pthread_join(watcher_, NULL);
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+#endif
+}
+
 static ShadowInodeState*
 lookup_by_inode(fuse_ino_t inode)
 {
@@ -88,6 +565,26 @@ lookup_by_path(const std::string& path)
     return state;
 }
 
+// Whether changes to path made behind our back will be seen, i.e. the
+// directory holding it is watched
+static bool
+in_watched_dir(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    ShadowInodeState* dir = slash == std::string::npos ?
+        lookup_by_inode(FUSE_ROOT_ID) : lookup_by_path(path.substr(0, slash));
+    return dir != NULL && dir->watched_;
+}
+
+// How long the kernel may keep what it's told about path: timeout if
+// it's watched, otherwise only as long as it could before the watcher
+// existed.
+static double
+cache_timeout(const std::string& path, double timeout)
+{
+    return in_watched_dir(path) ? timeout : UNWATCHED_TIMEOUT;
+}
+
 static bool
 add_link(ShadowInodeState* state, const char* name)
 {
@@ -141,7 +638,9 @@ gen_entry(fuse_entry_param* ent, const char* op, fuse_ino_t parent,
           ShadowInodeState** statep = NULL)
 {
     std::string local_path = DATA_DIR + path;
-    if (lstat(local_path.c_str(), &ent->attr) != 0) {
+    if ((must_create || ! take_prefetched(path, &ent->attr)) &&
+        lstat(local_path.c_str(), &ent->attr) != 0)
+    {
         dsyslog("gen_entry(%s) parent inode %lu local path %s: %s\n",
                 op, parent, local_path.c_str(), strerror(errno));
         return errno;
@@ -168,6 +667,10 @@ gen_entry(fuse_entry_param* ent, const char* op, fuse_ino_t parent,
         state = new ShadowInodeState(path);
         inode_map_[ent->attr.st_ino] = state;
         path_map_[path] = state;
+        if (S_ISDIR(ent->attr.st_mode)) {
+            state->attr = ent->attr;
+            watch_dir(state);
+        }
     
         dsyslog("gen_entry(%s) parent inode %lu path %s... created %s -> %llu\n",
                 op, parent, path.c_str(), local_path.c_str(),
@@ -179,8 +682,8 @@ gen_entry(fuse_entry_param* ent, const char* op, fuse_ino_t parent,
     
     ent->ino = ent->attr.st_ino;
     ent->generation = 1;
-    ent->attr_timeout = ATTR_TIMEOUT;
-    ent->entry_timeout = ATTR_TIMEOUT;
+    ent->attr_timeout = cache_timeout(path, ATTR_TIMEOUT);
+    ent->entry_timeout = ent->attr_timeout;
 
     if (statep) {
         *statep = state;
@@ -198,6 +701,7 @@ shadow_ll_init(void *userdata, struct fuse_conn_info *conn)
     ShadowInodeState* state = new ShadowInodeState("");
     state->attr.st_ino = FUSE_ROOT_ID;
     inode_map_[FUSE_ROOT_ID] = state;
+    watch_dir(state);
 }
 
 static void
@@ -247,7 +751,13 @@ shadow_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     
     fuse_entry_param ent;
     err = gen_entry(&ent, "lookup", parent, name, path, false /* must_create */, NULL);
-    if (err != 0) {
+    if (err == ENOENT) {
+        // A negative entry lets the kernel answer repeated misses
+        // itself, until something is created under the name.
+        memset(&ent, 0, sizeof(ent));
+        ent.entry_timeout = cache_timeout(path, NEGATIVE_TIMEOUT);
+        fuse_reply_entry(req, &ent);
+    } else if (err != 0) {
         fuse_reply_err(req, err);
     } else {
         fuse_reply_entry(req, &ent);
@@ -261,6 +771,9 @@ del_state(ShadowInodeState* state)
             static_cast<unsigned long long>(state->attr.st_ino));
     
     inode_map_.erase(state->attr.st_ino);
+    if (S_ISDIR(state->attr.st_mode)) {
+        unwatch_dir(state);
+    }
 
     path_map_.erase(state->path_);
     LinkVector::iterator lvi;
@@ -302,7 +815,7 @@ shadow_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     st = state->attr;
     dsyslog("getattr %lu... success %s\n", ino, local_path.c_str());
         
-    fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+    fuse_reply_attr(req, &st, cache_timeout(state->path_, ATTR_TIMEOUT));
 }
 
 static void
@@ -314,8 +827,10 @@ shadow_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         fuse_reply_err(req, ENOENT);
         return;
     }
+    forget_prefetched();
 
     std::string local_path = DATA_DIR + state->path_;
+    OwnChange own(ino, local_path);
     if (to_set & FUSE_SET_ATTR_MODE) {
         WRAPPED_SYSCALL(chmod, local_path.c_str(), attr->st_mode);
         state->attr.st_mode = attr->st_mode;
@@ -345,7 +860,7 @@ shadow_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 // #define FUSE_SET_ATTR_ATIME	(1 << 4)
 // #define FUSE_SET_ATTR_MTIME	(1 << 5)
 
-    fuse_reply_attr(req, &state->attr, ATTR_TIMEOUT);
+    fuse_reply_attr(req, &state->attr, cache_timeout(state->path_, ATTR_TIMEOUT));
 }
 
 static void
@@ -396,12 +911,14 @@ shadow_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 
     dsyslog("create(%s): opening file flags %o mode %o\n",
             local_path.c_str(), fi->flags, mode);
+    OwnEntries own(path);
     int fd = open(local_path.c_str(), fi->flags | O_CREAT | O_EXCL, mode);
     if (fd < 0) {
         dsyslog("create(%s): error %s\n", local_path.c_str(), strerror(errno));
         fuse_reply_err(req, errno);
         return;
     }
+    own.done();
 
     fuse_entry_param ent;
     ShadowInodeState* state;
@@ -413,7 +930,7 @@ shadow_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 
     state->local_fd_ = fd;
     fi->direct_io = OPEN_DIRECT_IO;
-    fi->keep_cache = OPEN_KEEP_CACHE;
+    fi->keep_cache = OPEN_KEEP_CACHE && in_watched_dir(path);
     fi->fh = (u_int64_t)state;
 
     fuse_reply_create(req, &ent, fi);
@@ -435,7 +952,9 @@ shadow_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     
     std::string local_path = DATA_DIR + path;
 
+    OwnEntries own(path);
     WRAPPED_SYSCALL(mkdir, local_path.c_str(), mode);
+    own.done();
 
     fuse_entry_param ent;
     ShadowInodeState* state;
@@ -453,12 +972,14 @@ unlink_or_rmdir(const char* op, fuse_req_t req, fuse_ino_t parent, const char *n
 {
     // Lookup the parent inode to get the path
     // Also need path -> state mapping
+    forget_prefetched();
     std::string path;
     int err = resolve_path(parent, name, &path);
     if (err != 0) {
         fuse_reply_err(req, err);
         return;
     }
+    OwnEntries own(path);
 
     ShadowInodeState* state = lookup_by_path(path);
     if (!state) {
@@ -492,6 +1013,7 @@ unlink_or_rmdir(const char* op, fuse_req_t req, fuse_ino_t parent, const char *n
         fuse_reply_err(req, errno);
         return;
     }
+    own.done();
 
     path_map_.erase(path);
     
@@ -529,7 +1051,9 @@ shadow_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
 
     std::string local_path = DATA_DIR + path;
 
+    OwnEntries own(path);
     WRAPPED_SYSCALL(symlink, link, local_path.c_str());
+    own.done();
 
     struct fuse_entry_param ent;
     err = gen_entry(&ent, "symlink", parent, name, path, true, NULL);
@@ -547,6 +1071,7 @@ shadow_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 {
     std::string path, newpath;
     int err;
+    forget_prefetched();
 
     err = resolve_path(parent, name, &path);
     if (err != 0) {
@@ -576,12 +1101,14 @@ shadow_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 
     std::string local_path = DATA_DIR + path;
     std::string local_newpath = DATA_DIR + newpath;
+    OwnEntries own(path, newpath);
 
     err = rename(local_path.c_str(), local_newpath.c_str());
     if (err != 0) {
         fuse_reply_err(req, err);
         return;
     }
+    own.done();
 
     // update the local state
     path_map_.erase(path);
@@ -605,15 +1132,19 @@ shadow_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
         fuse_reply_err(req, ENOENT);
         return;
     }
+    forget_prefetched();
     
     std::string newpath;
     int err = resolve_path(newparent, newname, &newpath);
     
     std::string local_path1 = DATA_DIR + state->path_;
     std::string local_path2 = DATA_DIR + newpath;
+    OwnEntries own(newpath);
+    OwnChange own_inode(ino, local_path1);
 
     dsyslog("link: hard link %s -> %s\n", newpath.c_str(), state->path_.c_str());
     WRAPPED_SYSCALL(link, local_path1.c_str(), local_path2.c_str());
+    own.done();
 
     struct fuse_entry_param ent;
     err = gen_entry(&ent, "link", newparent, newname, newpath, false);
@@ -636,7 +1167,14 @@ shadow_ll_open(fuse_req_t req, fuse_ino_t ino,
     }
 
     std::string local_path = DATA_DIR + state->path_;
-    int fd = ::open(local_path.c_str(), fi->flags);
+    int fd;
+    if (fi->flags & O_TRUNC) {
+        forget_prefetched();
+        OwnChange own(ino, local_path);
+        fd = ::open(local_path.c_str(), fi->flags);
+    } else {
+        fd = ::open(local_path.c_str(), fi->flags);
+    }
     if (fd < 0) {
         fuse_reply_err(req, errno);
         return;
@@ -644,7 +1182,7 @@ shadow_ll_open(fuse_req_t req, fuse_ino_t ino,
 
     state->local_fd_ = fd;
     fi->direct_io = OPEN_DIRECT_IO;
-    fi->keep_cache = OPEN_KEEP_CACHE;
+    fi->keep_cache = OPEN_KEEP_CACHE && in_watched_dir(state->path_);
     fi->fh = (u_int64_t)state;
     fuse_reply_open(req, fi);
 }
@@ -680,6 +1218,8 @@ shadow_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         fuse_reply_err(req, ENOENT);
         return;
     }
+    forget_prefetched();
+    OwnChange own(ino, std::string(), state->local_fd_);
     
     dsyslog("write ino %lu path %s\n", ino, state->path_.c_str());
     int rc = pwrite(state->local_fd_, buf, size, off);
@@ -771,6 +1311,8 @@ shadow_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     struct stat st;
     char name[256];
 
+    ShadowInodeState* state = lookup_by_inode(ino);
+
     if (off != 0) {
         seekdir(dir, off);
     }
@@ -801,6 +1343,19 @@ shadow_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
         if (entsz < size) {
             size -= entsz;
             bp   += entsz;
+
+            PrefetchedAttr pre;
+            pre.gen = prefetch_gen();
+            if (state && strcmp(name, ".") && strcmp(name, "..") &&
+                fstatat(dirfd(dir), name, &pre.attr, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                pre.when = time(NULL);
+                if (ino == FUSE_ROOT_ID) {
+                    put_prefetched(name, pre);
+                } else {
+                    put_prefetched(state->path_ + "/" + name, pre);
+                }
+            }
         } else {
             dsyslog("readdir(%lu): can't add entry %s: size %zu > remaining %zu\n",
                     ino, name, entsz, size);
@@ -18,13 +18,38 @@
  */
 
 #include "shadowfs.h"
+#include <cstddef>
 #include <cstdlib>
 #include <signal.h>
 
 MountTable _mtab;
 std::string DATA_DIR;
+ShadowConfig _config;
 int debug = 0;
 
+#define SHADOWFS_OPT(t, p, v) { t, offsetof(ShadowConfig, p), v }
+
+static struct fuse_opt shadowfs_opts[] = {
+    SHADOWFS_OPT("write_behind",      write_behind_,  1),
+    SHADOWFS_OPT("repl_threads=%u",   repl_threads_,  0),
+    SHADOWFS_OPT("repl_queue_mb=%u",  repl_queue_mb_, 0),
+    SHADOWFS_OPT("coalesce_kb=%u",    coalesce_kb_,   0),
+    SHADOWFS_OPT("coalesce_ms=%u",    coalesce_ms_,   0),
+    SHADOWFS_OPT("trip_ms=%u",        trip_ms_,       0),
+    SHADOWFS_OPT("probe_secs=%u",     probe_secs_,    0),
+    SHADOWFS_OPT("deadline_ms=%u",    deadline_ms_,   0),
+    SHADOWFS_OPT("settle_ms=%u",      settle_ms_,     0),
+    SHADOWFS_OPT("delta_ms=%u",       delta_ms_,      0),
+    SHADOWFS_OPT("stream_rewrites",   stream_rewrites_, 1),
+    SHADOWFS_OPT("shadow_kbps=%u",    shadow_kbps_,   0),
+    SHADOWFS_OPT("shadow_ops=%u",     shadow_ops_,    0),
+    SHADOWFS_OPT("attr_cache_secs=%u", attr_cache_secs_, 0),
+    SHADOWFS_OPT("negative_cache_secs=%u", negative_cache_secs_, 0),
+    SHADOWFS_OPT("dir_cache_secs=%u", dir_cache_secs_, 0),
+    SHADOWFS_OPT("prefetch_threads=%u", prefetch_threads_, 0),
+    FUSE_OPT_END
+};
+
 int
 read_mounts()
 {
@@ -65,6 +90,28 @@ read_mounts()
     }
 
     closedir(dp);
+
+    // <mount>@<name> adds another target to a mount, which shares its
+    // local-only patterns
+    MountTable::iterator iter = _mtab.begin();
+    while (iter != _mtab.end()) {
+        const std::string& name = iter->first;
+        size_t at = name.find('@');
+        std::string source = name.substr(0, at);
+        if (at != std::string::npos) {
+            MountTable::iterator mount = _mtab.find(source);
+            if (mount == _mtab.end() || source.find('@') != std::string::npos) {
+                syslog(LOG_ERR, "no mount %s for target %s\n",
+                       source.c_str(), name.c_str());
+                _mtab.erase(iter++);
+                continue;
+            }
+            iter->second.source_ = source;
+            mount->second.targets_.push_back(name);
+        }
+        load_local_only(&iter->second, DATA_DIR + "/.localonly/" + source);
+        ++iter;
+    }
     return 0;
 }
 
@@ -85,6 +132,12 @@ static void toggle_debug(int signo) {
 int main(int argc, char *argv[])
 {
     DATA_DIR = std::string(getenv("HOME")) + "/shadowfs_data";
+
+    // The barrier client only talks to a running daemon, which may be
+    // someone else's, so it needs neither our mounts nor our log.
+    if (argc > 1 && ! strcmp(argv[1], "--barrier")) {
+        return barrier_main(argc - 2, argv + 2);
+    }
     
     openlog("shadowfs", LOG_PID | LOG_NDELAY, LOG_USER);
     syslog(LOG_NOTICE, "shadowfs initializing... (data dir %s)", DATA_DIR.c_str());
@@ -100,6 +153,33 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (argc > 1 && ! strcmp(argv[1], "--reconcile")) {
+        umask(0);
+        return reconcile_main(argc - 2, argv + 2);
+    }
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &_config, shadowfs_opts, NULL) == -1) {
+        return -1;
+    }
+
+    // The kernel can hold on to attributes and missing names as long
+    // as we do, since it sees every change to them. Inserted ahead of
+    // the user's options so that an explicit timeout still wins.
+    if (_config.attr_cache_secs_ != 0) {
+        char opt[64];
+        snprintf(opt, sizeof(opt), "-oattr_timeout=%u", _config.attr_cache_secs_);
+        fuse_opt_insert_arg(&args, 1, opt);
+    }
+    if (_config.negative_cache_secs_ != 0) {
+        char opt[64];
+        snprintf(opt, sizeof(opt), "-onegative_timeout=%u",
+                 _config.negative_cache_secs_);
+        fuse_opt_insert_arg(&args, 1, opt);
+    }
+
     umask(0);
-    return fuse_main(argc, argv, &dispatch_ops, NULL);
+    int ret = fuse_main(args.argc, args.argv, &dispatch_ops, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
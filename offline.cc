@@ -18,9 +18,24 @@
  */
 
 #include "shadowfs.h"
+#include <pthread.h>
+#include <sys/statvfs.h>
 
 bool all_online = true;
 
+// Called once trip_mount has taken a mount offline. The replication
+// code sets it to journal the ops still queued for the mount.
+void (*_on_trip)(const char* path) = NULL;
+
+// Weight of the latest sample in the moving averages
+#define HEALTH_ALPHA 0.125
+
+// Error rate above which a mount is taken offline
+#define HEALTH_MAX_ERROR_RATE 0.5
+
+// Protects the online state and health statistics of all mounts
+static pthread_mutex_t health_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
 void
 toggle_all_offline(int)
 {
@@ -40,26 +55,197 @@ is_offline(const char* path)
         return true;
     }
 
-    // Special-case hack for .glimpse files to keep them only on the
-    // local FS for efficiency by pretending they're "offline"
-    if (strstr(path, "/.glimpse_")) {
-        return true;
+    MountTable::iterator iter = _mtab.find(root_dir(path));
+    if (iter != _mtab.end()) {
+        pthread_mutex_lock(&health_lock_);
+        bool online = iter->second.online_;
+        pthread_mutex_unlock(&health_lock_);
+        if (! online) {
+            return true;
+        }
     }
 
-    // Ditto for .git files
-    if (strstr(path, "/.git/")) {
+    return is_local_only(path);
+}
+
+// Errors that indicate a problem with the server or the transport
+// rather than with the operation itself
+bool
+is_transport_error(int err)
+{
+    switch (err) {
+    case EIO:
+    case ESTALE:
+    case ETIMEDOUT:
+    case ENOTCONN:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case ECONNRESET:
+    case ECONNREFUSED:
         return true;
+    default:
+        return false;
     }
-    
-    // Ditto for the Mac's ._ files
-    if (strstr(path, "/._")) {
-        return true;
+}
+
+static double
+elapsed_ms(const struct timeval* start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+// A tripped mount is probed periodically from its own thread, so a
+// probe that hangs on a dead server doesn't hold up the others.
+static void*
+probe_mount(void* arg)
+{
+    std::string root = *(std::string*)arg;
+    delete (std::string*)arg;
+    MountInfo& mi = _mtab.find(root)->second;
+
+    while (1) {
+        sleep(_config.probe_secs_ ? _config.probe_secs_ : 1);
+
+        struct timeval start;
+        struct statvfs st;
+        gettimeofday(&start, NULL);
+        int res = statvfs(mi.path_.c_str(), &st);
+        double ms = elapsed_ms(&start);
+
+        if (res == 0 && ms < _config.trip_ms_) {
+            pthread_mutex_lock(&health_lock_);
+            mi.online_     = true;
+            mi.probing_    = false;
+            mi.latency_ms_ = ms;
+            mi.error_rate_ = 0;
+            pthread_mutex_unlock(&health_lock_);
+
+            syslog(LOG_NOTICE, "mount %s back online (probe took %.1f ms)\n",
+                   root.c_str(), ms);
+            return NULL;
+        }
+
+        dsyslog("probe of mount %s failed: %s, %.1f ms\n", root.c_str(),
+                res == 0 ? "slow" : strerror(errno), ms);
     }
+}
 
-    // Ditto for .svn/lock files
-    if (strstr(path, "/.svn/lock")) {
-        return true;
+void
+shadow_result(const char* path, const struct timeval* start, int err,
+              off_t bytes)
+{
+    double ms = elapsed_ms(start);
+    if (bytes > COPY_CHUNK) {
+        ms *= (double)COPY_CHUNK / bytes;
+    }
+
+    std::string root = root_dir(path);
+    MountTable::iterator iter = _mtab.find(root);
+    if (iter == _mtab.end()) {
+        return;
+    }
+    MountInfo& mi = iter->second;
+
+    pthread_mutex_lock(&health_lock_);
+    mi.latency_ms_ += HEALTH_ALPHA * (ms - mi.latency_ms_);
+    mi.error_rate_ += HEALTH_ALPHA *
+                      ((is_transport_error(err) ? 1.0 : 0.0) - mi.error_rate_);
+
+    double latency_ms = mi.latency_ms_;
+    double error_rate = mi.error_rate_;
+    pthread_mutex_unlock(&health_lock_);
+
+    if (latency_ms > _config.trip_ms_ || error_rate > HEALTH_MAX_ERROR_RATE) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "latency %.1f ms, error rate %.2f",
+                 latency_ms, error_rate);
+        trip_mount(path, reason);
+    }
+}
+
+void
+trip_mount(const char* path, const char* reason)
+{
+    std::string root = root_dir(path);
+    MountTable::iterator iter = _mtab.find(root);
+    if (iter == _mtab.end()) {
+        return;
+    }
+    MountInfo& mi = iter->second;
+
+    pthread_mutex_lock(&health_lock_);
+    bool trip = mi.online_ && ! mi.probing_;
+    if (trip) {
+        mi.online_  = false;
+        mi.probing_ = true;
+    }
+    pthread_mutex_unlock(&health_lock_);
+
+    if (! trip) {
+        return;
     }
     
-    return false;
+    syslog(LOG_NOTICE, "taking mount %s offline: %s\n", root.c_str(), reason);
+
+    pthread_t tid;
+    int res = pthread_create(&tid, NULL, probe_mount, new std::string(root));
+    if (res != 0) {
+        // without a probe the mount would never come back
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(res));
+        pthread_mutex_lock(&health_lock_);
+        mi.online_  = true;
+        mi.probing_ = false;
+        pthread_mutex_unlock(&health_lock_);
+    } else {
+        pthread_detach(tid);
+        if (_on_trip != NULL) {
+            _on_trip(path);
+        }
+    }
+}
+
+// Files that are only ever kept on the local FS for efficiency, by
+// pretending they're "offline", when a mount has no pattern file
+static const char* default_local_only[] = {
+    ".glimpse_*",
+    ".git/",
+    "._*",      // the Mac's resource forks
+    "**/.svn/lock",
+};
+
+void
+load_local_only(MountInfo* mi, const std::string& file)
+{
+    if (mi->local_only_.load(file)) {
+        syslog(LOG_NOTICE, "loaded local-only patterns from %s\n", file.c_str());
+        return;
+    }
+
+    if (errno != ENOENT) {
+        syslog(LOG_ERR, "error reading %s: %s\n", file.c_str(), strerror(errno));
+    }
+    for (size_t i = 0; i < sizeof(default_local_only) / sizeof(char*); ++i) {
+        mi->local_only_.add(default_local_only[i]);
+    }
+}
+
+bool
+is_local_only(const char* path)
+{
+    std::string root = root_dir(path);
+    MountTable::const_iterator iter = _mtab.find(root);
+    if (iter == _mtab.end()) {
+        return false;
+    }
+
+    const char* rel = path + root.length() + 1;
+    if (*rel == '/') {
+        rel++;
+    }
+    return *rel != '\0' && iter->second.local_only_.match(rel);
 }
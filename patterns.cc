@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+
+// Each glob is compiled into a chain of states in one shared NFA. A
+// state either consumes a character and moves on (step_), consumes a
+// character and stays put (loop_), or moves on without consuming
+// anything (eps_). All the patterns are then run together over the
+// path, keeping the set of live states, so the cost of a match depends
+// on the length of the path rather than on the number of patterns.
+
+int
+PatternSet::new_state()
+{
+    states_.push_back(State());
+    return states_.size() - 1;
+}
+
+// Parses a [...] class starting at pattern[i], which is left pointing
+// at the closing bracket. Returns false if the class isn't closed.
+static bool
+parse_class(const std::string& pattern, size_t* i, std::bitset<256>* chars)
+{
+    size_t j = *i + 1;
+    bool negate = false;
+    if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^')) {
+        negate = true;
+        ++j;
+    }
+
+    std::bitset<256> set;
+    bool first = true;
+    while (j < pattern.size() && (pattern[j] != ']' || first)) {
+        unsigned char lo = pattern[j];
+        if (lo == '\\' && j + 1 < pattern.size()) {
+            lo = pattern[++j];
+        }
+        unsigned char hi = lo;
+        if (j + 2 < pattern.size() && pattern[j + 1] == '-' &&
+            pattern[j + 2] != ']')
+        {
+            hi = pattern[j + 2];
+            j += 2;
+        }
+        for (unsigned c = lo; c <= hi; ++c) {
+            set.set(c);
+        }
+        first = false;
+        ++j;
+    }
+
+    if (j >= pattern.size()) {
+        return false;
+    }
+
+    if (negate) {
+        set.flip();
+    }
+    set.reset('/');
+    *chars = set;
+    *i = j;
+    return true;
+}
+
+bool
+PatternSet::add(const std::string& line)
+{
+    std::string pattern = line;
+
+    // trailing whitespace is ignored unless escaped
+    while (! pattern.empty() && isspace(pattern[pattern.size() - 1]) &&
+           ! (pattern.size() >= 2 && pattern[pattern.size() - 2] == '\\'))
+    {
+        pattern.erase(pattern.size() - 1);
+    }
+    if (pattern.empty() || pattern[0] == '#') {
+        return false;
+    }
+
+    bool negate = false;
+    if (pattern[0] == '!') {
+        negate = true;
+        pattern.erase(0, 1);
+    }
+
+    // A trailing slash only matches directories. Since all we have is
+    // the path, that means only things below a directory of that name.
+    bool dir_only = false;
+    if (pattern.size() > 1 && pattern[pattern.size() - 1] == '/') {
+        dir_only = true;
+        pattern.erase(pattern.size() - 1);
+    }
+
+    // A pattern with a slash in it is relative to the root of the
+    // mount, otherwise it matches a name at any depth.
+    bool anchored = pattern.find('/') != std::string::npos;
+    if (pattern.compare(0, 3, "**/") == 0) {
+        anchored = false;
+        pattern.erase(0, 3);
+    } else if (pattern[0] == '/') {
+        pattern.erase(0, 1);
+    }
+    if (pattern.empty()) {
+        return false;
+    }
+
+    std::bitset<256> all;
+    all.set();
+    std::bitset<256> not_slash = all;
+    not_slash.reset('/');
+    
+    int id = negate_.size();
+    int start = new_state();
+    int s = start;
+
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        int next = new_state();
+
+        if (pattern.compare(i, 3, "**/") == 0 &&
+            (i == 0 || pattern[i - 1] == '/'))
+        {
+            // "**/" at the start of a name matches any number of whole
+            // names, each with its slash. s can only be left without
+            // consuming anything here at a name boundary, and the name
+            // state only gets back to s through a slash.
+            i += 2;
+            int name = new_state();
+            State& st = states_[s];
+            st.step_ = not_slash;
+            st.out_  = name;
+            st.eps_  = next;
+            State& in_name = states_[name];
+            in_name.loop_ = not_slash;
+            in_name.step_.set('/');
+            in_name.out_  = s;
+            s = next;
+            continue;
+        }
+
+        State& st = states_[s];
+        if (c == '*' && i + 1 < pattern.size() && pattern[i + 1] == '*') {
+            i++;
+            st.loop_ = all;
+            st.eps_  = next;
+        } else if (c == '*') {
+            st.loop_ = not_slash;
+            st.eps_  = next;
+        } else if (c == '?') {
+            st.step_ = not_slash;
+        } else if (c == '[' && parse_class(pattern, &i, &st.step_)) {
+            // parse_class filled in the step
+        } else {
+            if (c == '\\' && i + 1 < pattern.size()) {
+                c = pattern[++i];
+            }
+            st.step_.set((unsigned char)c);
+        }
+        st.out_ = next;
+        s = next;
+    }
+    
+    states_[s].accept_ = id;
+    
+    (anchored ? anchored_ : floating_).push_back(start);
+    negate_.push_back(negate);
+    dir_only_.push_back(dir_only);
+    return true;
+}
+
+bool
+PatternSet::load(const std::string& file)
+{
+    FILE* f = fopen(file.c_str(), "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        add(line);
+    }
+    fclose(f);
+    return true;
+}
+
+// Adds state s and everything reachable from it without consuming a
+// character to the set.
+static inline void
+add_state(const std::vector<PatternSet::State>& states,
+          std::vector<int>* set, std::vector<bool>* live, int s)
+{
+    while (s != -1 && ! (*live)[s]) {
+        (*live)[s] = true;
+        set->push_back(s);
+        s = states[s].eps_;
+    }
+}
+
+bool
+PatternSet::match(const char* path) const
+{
+    if (states_.empty()) {
+        return false;
+    }
+
+    std::vector<int>  cur, next;
+    std::vector<bool> live(states_.size()), next_live(states_.size());
+    int best = -1;
+
+    for (size_t i = 0; i < anchored_.size(); ++i) {
+        add_state(states_, &cur, &live, anchored_[i]);
+    }
+
+    for (const char* p = path; ; ++p) {
+        unsigned char c = *p;
+
+        // At the start of each name the floating patterns get another
+        // go, and at its end any pattern that matched the path so far
+        // covers everything beneath it.
+        if (p == path || p[-1] == '/') {
+            for (size_t i = 0; i < floating_.size(); ++i) {
+                add_state(states_, &cur, &live, floating_[i]);
+            }
+        }
+        if (c == '/' || c == '\0') {
+            for (size_t i = 0; i < cur.size(); ++i) {
+                int id = states_[cur[i]].accept_;
+                if (id > best && (c == '/' || ! dir_only_[id])) {
+                    best = id;
+                }
+            }
+        }
+        if (c == '\0' || cur.empty()) {
+            if (c == '\0' || floating_.empty()) {
+                break;
+            }
+        }
+
+        next.clear();
+        for (size_t i = 0; i < cur.size(); ++i) {
+            const State& st = states_[cur[i]];
+            if (st.loop_[c]) {
+                add_state(states_, &next, &next_live, cur[i]);
+            }
+            if (st.step_[c]) {
+                add_state(states_, &next, &next_live, st.out_);
+            }
+        }
+
+        for (size_t i = 0; i < cur.size(); ++i) {
+            live[cur[i]] = false;
+        }
+        cur.swap(next);
+        live.swap(next_live);
+    }
+
+    return best != -1 && ! negate_[best];
+}
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#include <deque>
+#include <vector>
+
+// shadowfs --reconcile walks a mount and its shadow side by side and
+// repairs the shadow wherever it differs from the local copy. The tree
+// is walked by a pool of threads, each with its own queue of
+// directories. A walker works through its own queue depth first and
+// steals from the other end of someone else's when it runs dry, so
+// that a few huge directories don't leave the rest of the pool idle.
+//
+// If the daemon keeps a change index for the mount (see index.cc),
+// only the subtrees that changed since the last reconcile are walked,
+// unless --full is given.
+
+#define RECONCILE_THREADS 16
+
+struct ReconcileStats {
+    ReconcileStats() : dirs_(0), entries_(0), repaired_(0), extra_(0),
+                       errors_(0) {}
+
+    size_t dirs_;
+    size_t entries_;
+    size_t repaired_;
+    size_t extra_;
+    size_t errors_;
+};
+
+// A directory to reconcile. Without an index node every entry in it
+// is checked, otherwise only the ones the node says have changed.
+struct WalkItem {
+    WalkItem(const std::string& path = "", const IndexNode* node = NULL)
+        : path_(path), node_(node) {}
+
+    std::string      path_;   // like /mount/dir
+    const IndexNode* node_;
+};
+
+struct Walker {
+    Walker() { pthread_mutex_init(&lock_, NULL); }
+
+    int                     id_;
+    pthread_t               thread_;
+    pthread_mutex_t         lock_;
+    std::deque<WalkItem>    dirs_;
+    ReconcileStats          stats_;
+};
+
+static std::vector<Walker*> walkers_;
+static size_t          outstanding_ = 0;  // directories queued or in progress
+static unsigned        generation_  = 0;  // bumped whenever work is queued
+static pthread_mutex_t work_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_cv_   = PTHREAD_COND_INITIALIZER;
+
+static bool opt_checksum_ = false;
+static bool opt_delete_   = false;
+static bool opt_dry_run_  = false;
+static bool opt_full_     = false;
+
+static void
+push_dir(Walker* w, const std::string& path, const IndexNode* node)
+{
+    pthread_mutex_lock(&work_lock_);
+    outstanding_++;
+    generation_++;
+    pthread_cond_signal(&work_cv_);
+    pthread_mutex_unlock(&work_lock_);
+
+    pthread_mutex_lock(&w->lock_);
+    w->dirs_.push_back(WalkItem(path, node));
+    pthread_mutex_unlock(&w->lock_);
+}
+
+static bool
+take_dir(Walker* w, WalkItem* item, bool steal)
+{
+    pthread_mutex_lock(&w->lock_);
+    bool found = ! w->dirs_.empty();
+    if (found && steal) {
+        *item = w->dirs_.front();
+        w->dirs_.pop_front();
+    } else if (found) {
+        *item = w->dirs_.back();
+        w->dirs_.pop_back();
+    }
+    pthread_mutex_unlock(&w->lock_);
+    return found;
+}
+
+// Gets the next directory for a walker, or returns false once the
+// whole tree has been walked.
+static bool
+next_dir(Walker* w, WalkItem* item)
+{
+    while (1) {
+        pthread_mutex_lock(&work_lock_);
+        unsigned gen = generation_;
+        pthread_mutex_unlock(&work_lock_);
+
+        if (take_dir(w, item, false)) {
+            return true;
+        }
+        for (size_t i = 1; i < walkers_.size(); ++i) {
+            if (take_dir(walkers_[(w->id_ + i) % walkers_.size()], item, true)) {
+                return true;
+            }
+        }
+
+        pthread_mutex_lock(&work_lock_);
+        while (outstanding_ != 0 && generation_ == gen) {
+            pthread_cond_wait(&work_cv_, &work_lock_);
+        }
+        bool done = outstanding_ == 0;
+        pthread_mutex_unlock(&work_lock_);
+        if (done) {
+            return false;
+        }
+    }
+}
+
+static void
+finish_dir()
+{
+    pthread_mutex_lock(&work_lock_);
+    if (--outstanding_ == 0) {
+        pthread_cond_broadcast(&work_cv_);
+    }
+    pthread_mutex_unlock(&work_lock_);
+}
+
+typedef std::map<std::string, struct stat> DirEntries;
+
+static bool
+read_dir(const std::string& dir, DirEntries* entries)
+{
+    DIR* dp = opendir(dir.c_str());
+    if (dp == NULL) {
+        return false;
+    }
+
+    struct dirent* de;
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            (*entries)[de->d_name] = st;
+        }
+    }
+    closedir(dp);
+    return true;
+}
+
+static bool
+same_contents(const std::string& a, const std::string& b)
+{
+    int fd_a = open(a.c_str(), O_RDONLY);
+    int fd_b = open(b.c_str(), O_RDONLY);
+    bool same = fd_a != -1 && fd_b != -1;
+
+    std::vector<char> buf_a(COPY_CHUNK), buf_b(COPY_CHUNK);
+    while (same) {
+        ssize_t n = read(fd_a, &buf_a[0], buf_a.size());
+        if (n <= 0) {
+            same = n == 0 && read(fd_b, &buf_b[0], 1) == 0;
+            break;
+        }
+        ssize_t got = 0;
+        while (got < n) {
+            ssize_t m = read(fd_b, &buf_b[got], n - got);
+            if (m <= 0) {
+                break;
+            }
+            got += m;
+        }
+        same = got == n && memcmp(&buf_a[0], &buf_b[0], n) == 0;
+    }
+
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    return same;
+}
+
+static int
+remove_tree(const std::string& path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    if (! S_ISDIR(st.st_mode)) {
+        return unlink(path.c_str());
+    }
+
+    DirEntries entries;
+    read_dir(path, &entries);
+    DirEntries::iterator iter;
+    for (iter = entries.begin(); iter != entries.end(); ++iter) {
+        remove_tree(path + "/" + iter->first);
+    }
+    return rmdir(path.c_str());
+}
+
+static void
+report(const char* what, const std::string& path)
+{
+    printf("%s%s %s\n", opt_dry_run_ ? "would " : "", what, path.c_str());
+}
+
+// Makes the shadow copy of one entry match the local one, given what
+// both sides look like. Returns false on error.
+static bool
+repair(Walker* w, const std::string& path, const struct stat& local,
+       const struct stat* shadow)
+{
+    std::string local_path  = get_local_path(path.c_str());
+    std::string shadow_path = get_shadow_path(path.c_str());
+
+    // an entry of the wrong type has to go first
+    if (shadow && (shadow->st_mode & S_IFMT) != (local.st_mode & S_IFMT)) {
+        report("replace", path);
+        if (! opt_dry_run_ && remove_tree(shadow_path) != 0) {
+            return false;
+        }
+        shadow = NULL;
+    }
+
+    if (S_ISDIR(local.st_mode)) {
+        if (shadow == NULL) {
+            report("mkdir", path);
+            if (! opt_dry_run_) {
+                if (mkdir(shadow_path.c_str(), local.st_mode & 07777) != 0) {
+                    return false;
+                }
+                lchown(shadow_path.c_str(), local.st_uid, local.st_gid);
+            }
+        } else if ((shadow->st_mode & 07777) != (local.st_mode & 07777)) {
+            report("chmod", path);
+            if (! opt_dry_run_ &&
+                chmod(shadow_path.c_str(), local.st_mode & 07777) != 0)
+            {
+                return false;
+            }
+        } else {
+            return true;
+        }
+    } else if (S_ISLNK(local.st_mode)) {
+        char target[PATH_MAX], shadow_target[PATH_MAX];
+        ssize_t len = readlink(local_path.c_str(), target, sizeof(target) - 1);
+        if (len == -1) {
+            return false;
+        }
+        target[len] = '\0';
+
+        if (shadow) {
+            len = readlink(shadow_path.c_str(), shadow_target,
+                           sizeof(shadow_target) - 1);
+            if (len != -1) {
+                shadow_target[len] = '\0';
+                if (! strcmp(target, shadow_target)) {
+                    return true;
+                }
+            }
+        }
+
+        report("symlink", path);
+        if (! opt_dry_run_) {
+            if (shadow) {
+                unlink(shadow_path.c_str());
+            }
+            if (symlink(target, shadow_path.c_str()) != 0) {
+                return false;
+            }
+            lchown(shadow_path.c_str(), local.st_uid, local.st_gid);
+        }
+    } else if (S_ISREG(local.st_mode)) {
+        if (shadow && shadow->st_size == local.st_size &&
+            shadow->st_mtime == local.st_mtime &&
+            (shadow->st_mode & 07777) == (local.st_mode & 07777) &&
+            (! opt_checksum_ || same_contents(local_path, shadow_path)))
+        {
+            return true;
+        }
+
+        report("copy", path);
+        if (! opt_dry_run_ && CopyFileOp(path).call() != 0) {
+            return false;
+        }
+    } else {
+        // fifos and device nodes
+        if (shadow) {
+            return true;
+        }
+        report("mknod", path);
+        if (! opt_dry_run_ &&
+            mknod(shadow_path.c_str(), local.st_mode, local.st_rdev) != 0)
+        {
+            return false;
+        }
+    }
+
+    w->stats_.repaired_++;
+    return true;
+}
+
+// Returns the index node for a changed entry, or NULL if shadowfs
+// hasn't modified the entry since reconcile last checked it.
+static const IndexNode*
+changed_child(const IndexNode* node, const std::string& name)
+{
+    IndexNode::Children::const_iterator iter = node->children_.find(name);
+    if (iter == node->children_.end() ||
+        iter->second->local_ == iter->second->shadow_)
+    {
+        return NULL;
+    }
+    return iter->second;
+}
+
+static void
+reconcile_dir(Walker* w, const std::string& dir, const IndexNode* node)
+{
+    std::string local_dir  = get_local_path(dir.c_str());
+    std::string shadow_dir = get_shadow_path(dir.c_str());
+
+    DirEntries local, shadow;
+    if (! read_dir(local_dir, &local)) {
+        // A changed directory that has since gone away is dealt with
+        // as an entry of its parent.
+        if (node != NULL && errno == ENOENT) {
+            return;
+        }
+        syslog(LOG_ERR, "reconcile: error reading %s: %s\n",
+               local_dir.c_str(), strerror(errno));
+        w->stats_.errors_++;
+        return;
+    }
+    if (! read_dir(shadow_dir, &shadow) && ! opt_dry_run_) {
+        fprintf(stderr, "error reading %s: %s\n",
+                shadow_dir.c_str(), strerror(errno));
+        w->stats_.errors_++;
+        return;
+    }
+    w->stats_.dirs_++;
+
+    DirEntries::iterator iter;
+    for (iter = local.begin(); iter != local.end(); ++iter) {
+        std::string path = dir + "/" + iter->first;
+        const IndexNode* child = node ? changed_child(node, iter->first) : NULL;
+        if (is_local_only(path.c_str()) || (node != NULL && child == NULL)) {
+            shadow.erase(iter->first);
+            continue;
+        }
+        w->stats_.entries_++;
+
+        DirEntries::iterator match = shadow.find(iter->first);
+        const struct stat* st = match == shadow.end() ? NULL : &match->second;
+        if (! repair(w, path, iter->second, st)) {
+            fprintf(stderr, "error repairing %s: %s\n",
+                    path.c_str(), strerror(errno));
+            w->stats_.errors_++;
+        } else if (S_ISDIR(iter->second.st_mode)) {
+            // a directory that changed itself, say by being renamed
+            // into place, is walked in full
+            push_dir(w, path, child && ! child->changed_ ? child : NULL);
+        }
+        if (match != shadow.end()) {
+            shadow.erase(match);
+        }
+    }
+
+    // whatever is left exists only on the shadow side
+    for (iter = shadow.begin(); iter != shadow.end(); ++iter) {
+        std::string path = dir + "/" + iter->first;
+        if (is_local_only(path.c_str()) ||
+            (node != NULL && changed_child(node, iter->first) == NULL))
+        {
+            continue;
+        }
+        w->stats_.extra_++;
+        if (! opt_delete_) {
+            printf("extra %s\n", path.c_str());
+            continue;
+        }
+        report("delete", path);
+        if (! opt_dry_run_ && remove_tree(shadow_dir + "/" + iter->first) != 0) {
+            fprintf(stderr, "error deleting %s: %s\n",
+                    path.c_str(), strerror(errno));
+            w->stats_.errors_++;
+        }
+    }
+}
+
+static void*
+walker(void* arg)
+{
+    Walker* w = (Walker*)arg;
+    WalkItem item;
+    while (next_dir(w, &item)) {
+        reconcile_dir(w, item.path_, item.node_);
+        finish_dir();
+    }
+    return NULL;
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: shadowfs --reconcile <mount>[/<dir>] "
+            "[--checksum] [--delete] [--dry-run] [--full] [--threads N]\n");
+}
+
+// Runs shadowfs --reconcile with the arguments that follow it, and
+// returns the exit status.
+int
+reconcile_main(int argc, char* argv[])
+{
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+
+    std::string path = std::string("/") + argv[0];
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+
+    unsigned nthreads = RECONCILE_THREADS;
+    for (int i = 1; i < argc; ++i) {
+        if (! strcmp(argv[i], "--checksum")) {
+            opt_checksum_ = true;
+        } else if (! strcmp(argv[i], "--delete")) {
+            opt_delete_ = true;
+        } else if (! strcmp(argv[i], "--dry-run")) {
+            opt_dry_run_ = true;
+        } else if (! strcmp(argv[i], "--full")) {
+            opt_full_ = true;
+        } else if (! strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nthreads = std::max(atoi(argv[++i]), 1);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    std::string root = root_dir(path.c_str());
+    if (_mtab.find(root) == _mtab.end()) {
+        fprintf(stderr, "no shadowfs target configured for %s\n", root.c_str());
+        return 1;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    ChangeMap changes, verified;
+    bool indexed = read_index(root, &changes);
+    if (! indexed) {
+        changes.clear();
+    }
+    indexed = indexed && ! opt_full_;
+    read_verified(root, &verified);
+
+    // find the node for the directory we were asked about
+    IndexNode tree;
+    const IndexNode* top = NULL;
+    if (indexed) {
+        build_index_tree(root, changes, verified, &tree);
+        top = &tree;
+        size_t pos = root.size() + 1;
+        while (top != NULL && pos < path.size()) {
+            size_t end = path.find('/', pos + 1);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (top->changed_) {
+                break;
+            }
+            top = changed_child(top, path.substr(pos + 1, end - pos - 1));
+            pos = end;
+        }
+        if (top != NULL && top->changed_) {
+            top = NULL;
+            indexed = false;
+        }
+    }
+
+    for (unsigned i = 0; i < nthreads; ++i) {
+        Walker* w = new Walker();
+        w->id_ = i;
+        walkers_.push_back(w);
+    }
+    if (! indexed) {
+        push_dir(walkers_[0], path, NULL);
+    } else if (top != NULL && top->local_ != top->shadow_) {
+        push_dir(walkers_[0], path, top);
+    }
+
+    for (unsigned i = 0; i < nthreads; ++i) {
+        int err = pthread_create(&walkers_[i]->thread_, NULL, walker, walkers_[i]);
+        if (err != 0) {
+            fprintf(stderr, "error in pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+
+    ReconcileStats total;
+    for (unsigned i = 0; i < nthreads; ++i) {
+        pthread_join(walkers_[i]->thread_, NULL);
+        total.dirs_     += walkers_[i]->stats_.dirs_;
+        total.entries_  += walkers_[i]->stats_.entries_;
+        total.repaired_ += walkers_[i]->stats_.repaired_;
+        total.extra_    += walkers_[i]->stats_.extra_;
+        total.errors_   += walkers_[i]->stats_.errors_;
+        delete walkers_[i];
+    }
+    walkers_.clear();
+
+    // Everything the index had recorded under path has now been
+    // checked, so it can be marked verified. Entries for paths the
+    // daemon has since dropped are dropped here too.
+    if (total.errors_ == 0 && ! opt_dry_run_ && ! changes.empty()) {
+        ChangeMap::iterator iter;
+        for (iter = verified.begin(); iter != verified.end(); ) {
+            if (changes.find(iter->first) == changes.end()) {
+                verified.erase(iter++);
+            } else {
+                ++iter;
+            }
+        }
+        for (iter = changes.begin(); iter != changes.end(); ++iter) {
+            const std::string& p = iter->first;
+            if (p == path || (p.size() > path.size() && p[path.size()] == '/' &&
+                              ! p.compare(0, path.size(), path)))
+            {
+                verified[p] = iter->second;
+            }
+        }
+        write_verified(root, verified);
+    }
+
+    gettimeofday(&end, NULL);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    printf("%s: %zu directories, %zu entries, %zu repaired, %zu extra, "
+           "%zu errors in %.2fs\n", path.c_str(), total.dirs_, total.entries_,
+           total.repaired_, total.extra_, total.errors_, secs);
+    return total.errors_ == 0 ? 0 : 1;
+}
@@ -0,0 +1,1170 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+struct WriteOp : public ShadowOp {
+    WriteOp(const std::string& path, int fd, const char* buf,
+            size_t size, off_t offset)
+        : ShadowOp(path, size), fd_(fd), data_(buf, size), offset_(offset) {}
+
+    void apply() {
+        // If the mount went offline while this was queued, the data
+        // goes to the journal instead so the worker doesn't block on a
+        // stalled server.
+        if (shadow_offline(path_.c_str())) {
+            journal_record(J_WRITE, path_.c_str(), "", offset_, data_.size());
+            return;
+        }
+        
+        throttle(path_.c_str(), data_.size(), 0);
+        int res = SHADOW_CALL(path_.c_str(),
+                              pwrite(fd_, data_.data(), data_.size(), offset_));
+        if (res == -1) {
+            // The journal copies the range from the local file later.
+            syslog(LOG_ERR, "error in shadow write(%s): %s\n",
+                   path_.c_str(), strerror(errno));
+            journal_record(J_WRITE, path_.c_str(), "", offset_, data_.size());
+        }
+    }
+
+    int         fd_;
+    std::string data_;
+    off_t       offset_;
+};
+
+// Copies a file's dirty extents from the local fd, which the op owns,
+// to the shadow fd.
+struct ExtentsOp : public ShadowOp {
+    ExtentsOp(const std::string& path, int local_fd, int shadow_fd,
+              const ExtentSet& dirty)
+        : ShadowOp(path), local_fd_(local_fd), shadow_fd_(shadow_fd),
+          dirty_(dirty) {}
+
+    ~ExtentsOp() {
+        close(local_fd_);
+    }
+
+    off_t traffic() const { return dirty_.bytes(); }
+    
+    void apply() {
+        bool offline = shadow_offline(path_.c_str());
+        
+        ExtentSet::ExtentMap::const_iterator iter;
+        for (iter = dirty_.extents_.begin(); iter != dirty_.extents_.end(); ++iter) {
+            off_t length = iter->second - iter->first;
+            if (! offline) {
+                throttle(path_.c_str(), length, 0);
+            }
+            if (! offline &&
+                SHADOW_COPY(path_.c_str(), length,
+                            copy_range(local_fd_, shadow_fd_,
+                                       iter->first, length)) == -1)
+            {
+                syslog(LOG_ERR, "error in shadow write(%s): %s\n",
+                       path_.c_str(), strerror(errno));
+                offline = true;
+            }
+
+            // as with WriteOp, the journal copies the rest later
+            if (offline) {
+                journal_record(J_WRITE, path_.c_str(), "", iter->first, length);
+            }
+        }
+    }
+
+    int       local_fd_;
+    int       shadow_fd_;
+    ExtentSet dirty_;
+};
+
+struct CloseOp : public ShadowOp {
+    CloseOp(const std::string& path, int fd)
+        : ShadowOp(path), fd_(fd) {}
+
+    void apply() {
+        if (SHADOW_CALL(path_.c_str(), close(fd_)) != 0) {
+            syslog(LOG_ERR, "error in close(%d): %s\n", fd_, strerror(errno));
+        }
+    }
+
+    int fd_;
+};
+
+// The caller's open file only has an fd for the first target of a
+// mount. On the extra targets, files are opened by path on the worker
+// that applies the first write and kept open until the caller closes
+// the file. The ops for a path are applied one at a time, so an fd is
+// only ever used by one worker.
+typedef std::map<std::string, int> TargetFdTable;
+static TargetFdTable   target_fds_;
+static pthread_mutex_t target_fd_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+set_target_fd(const std::string& path, int fd)
+{
+    pthread_mutex_lock(&target_fd_lock_);
+    std::pair<TargetFdTable::iterator, bool> res =
+        target_fds_.insert(std::make_pair(path, fd));
+    int old = res.second ? -1 : res.first->second;
+    res.first->second = fd;
+    pthread_mutex_unlock(&target_fd_lock_);
+
+    if (old != -1) {
+        close(old);
+    }
+}
+
+static int
+get_target_fd(const std::string& path)
+{
+    pthread_mutex_lock(&target_fd_lock_);
+    TargetFdTable::iterator iter = target_fds_.find(path);
+    int fd = iter == target_fds_.end() ? -1 : iter->second;
+    pthread_mutex_unlock(&target_fd_lock_);
+
+    if (fd == -1) {
+        std::string shadow_path = get_shadow_path(path.c_str());
+        fd = SHADOW_CALL(path.c_str(), open(shadow_path.c_str(), O_WRONLY));
+        if (fd == -1) {
+            syslog(LOG_ERR, "error in shadow open(%s): %s\n",
+                   shadow_path.c_str(), strerror(errno));
+            return -1;
+        }
+        set_target_fd(path, fd);
+    }
+    return fd;
+}
+
+// Closes the fd kept open on an extra target's file, if any, for
+// example once the file has been replaced.
+void
+drop_target_fd(const std::string& path)
+{
+    pthread_mutex_lock(&target_fd_lock_);
+    TargetFdTable::iterator iter = target_fds_.find(path);
+    int fd = -1;
+    if (iter != target_fds_.end()) {
+        fd = iter->second;
+        target_fds_.erase(iter);
+    }
+    pthread_mutex_unlock(&target_fd_lock_);
+
+    if (fd != -1 && SHADOW_CALL(path.c_str(), close(fd)) != 0) {
+        syslog(LOG_ERR, "error in close(%d): %s\n", fd, strerror(errno));
+    }
+}
+
+// Creates or truncates a file on an extra target as the caller's open
+// did locally, keeping the fd for the writes that follow.
+struct TargetOpenOp : public ShadowCall {
+    TargetOpenOp(const std::string& path, int flags, mode_t mode, bool create,
+                 uid_t uid, gid_t gid)
+        : ShadowCall(path), flags_(flags), mode_(mode), create_(create),
+          uid_(uid), gid_(gid) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+        int flags = O_WRONLY | O_TRUNC | (create_ ? O_CREAT : 0);
+        
+        bool as_caller;
+        int fd;
+        {
+            ShadowCreds creds(uid_, gid_);
+            as_caller = creds.active_;
+            fd = SHADOW_CALL(path_.c_str(),
+                             open(shadow_path.c_str(), flags, mode_));
+        }
+        if (fd == -1 && as_caller && (errno == EACCES || errno == EPERM)) {
+            as_caller = false;
+            fd = SHADOW_CALL(path_.c_str(),
+                             open(shadow_path.c_str(), flags, mode_));
+        }
+        if (fd == -1) {
+            syslog(LOG_ERR, "error in shadow open(%s): %s\n",
+                   shadow_path.c_str(), strerror(errno));
+            return -1;
+        }
+        if (create_ && ! as_caller && fchown(fd, uid_, gid_) != 0) {
+            dsyslog("error in shadow fchown(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        set_target_fd(path_, fd);
+        return 0;
+    }
+
+    void journal() {
+        journal_open(path_.c_str(), flags_, mode_, create_, uid_, gid_);
+    }
+
+    ShadowCall* clone() const { return new TargetOpenOp(*this); }
+
+    int    flags_;
+    mode_t mode_;
+    bool   create_;
+    uid_t  uid_;
+    gid_t  gid_;
+};
+
+// The data of a write that goes to several targets, shared by their
+// ops rather than copied for each.
+struct WriteBuffer {
+    WriteBuffer(const char* buf, size_t size) : data_(buf, size), refs_(1) {}
+
+    void hold() { __sync_add_and_fetch(&refs_, 1); }
+    void release() {
+        if (__sync_sub_and_fetch(&refs_, 1) == 0) {
+            delete this;
+        }
+    }
+
+    std::string data_;
+    int         refs_;  // holders of the buffer, updated atomically
+};
+
+struct TargetWriteOp : public ShadowOp {
+    TargetWriteOp(const std::string& path, WriteBuffer* buf, off_t offset)
+        : ShadowOp(path, buf->data_.size()), buf_(buf), offset_(offset) {
+        buf_->hold();
+    }
+
+    ~TargetWriteOp() {
+        buf_->release();
+    }
+
+    void apply() {
+        const std::string& data = buf_->data_;
+        if (shadow_offline(path_.c_str())) {
+            journal_record(J_WRITE, path_.c_str(), "", offset_, data.size());
+            return;
+        }
+
+        throttle(path_.c_str(), data.size(), 0);
+        int fd = get_target_fd(path_);
+        if (fd == -1 ||
+            SHADOW_CALL(path_.c_str(),
+                        pwrite(fd, data.data(), data.size(), offset_)) == -1)
+        {
+            if (fd != -1) {
+                syslog(LOG_ERR, "error in shadow write(%s): %s\n",
+                       path_.c_str(), strerror(errno));
+            }
+            journal_record(J_WRITE, path_.c_str(), "", offset_, data.size());
+        }
+    }
+
+    WriteBuffer* buf_;
+    off_t        offset_;
+};
+
+struct TargetCloseOp : public ShadowOp {
+    TargetCloseOp(const std::string& path) : ShadowOp(path) {}
+
+    void apply() {
+        drop_target_fd(path_);
+    }
+};
+
+// Paths that have work and no worker are scheduled in a multi-level
+// queue. Each op is classed when it's queued: small updates from a
+// process that isn't churning through lots of files are interactive,
+// large transfers and anything from a process issuing more than
+// BULK_OPS_PER_SEC ops are bulk, and the rest (including background
+// work such as journal replay, which has no process) is in between. A
+// path is scheduled at the level of the most urgent op it has queued,
+// since its ops have to be applied in order anyway. Workers take the
+// most urgent path, except that a level that has been passed over for
+// AGE_MS per level below the top gets the next turn, so bulk work
+// keeps moving while interactive work jumps ahead of it.
+
+enum { PRIO_INTERACTIVE, PRIO_NORMAL, PRIO_BULK, PRIO_LEVELS };
+
+#define INTERACTIVE_BYTES (256 * 1024)
+#define BULK_BYTES        (4 * 1024 * 1024)
+#define BULK_OPS_PER_SEC  50
+#define AGE_MS            100
+
+struct OpQueue {
+    OpQueue() : busy_(false), busy_seq_(0), ready_level_(0), ready_seq_(0) {
+        memset(count_, 0, sizeof(count_));
+    }
+
+    int prio() const {
+        int level = 0;
+        while (level < PRIO_LEVELS - 1 && count_[level] == 0) {
+            level++;
+        }
+        return level;
+    }
+
+    std::deque<ShadowOp*> ops_;
+    bool                  busy_;       // a worker is applying the head op
+    unsigned long         busy_seq_;   // and its seq
+    unsigned              count_[PRIO_LEVELS];  // queued ops per level
+    int                   ready_level_;
+    unsigned long         ready_seq_;  // of its entry in ready_, 0 if none
+};
+
+typedef std::map<std::string, OpQueue> OpQueueTable;
+
+// An entry in the ready queue. A path is requeued at a better level
+// when a more urgent op arrives for it, which leaves a stale entry
+// behind; only the entry with the path's current seq counts.
+struct ReadyPath {
+    std::string    path_;
+    unsigned long  seq_;
+    struct timeval since_;
+};
+
+// Ops per second issued by a process, counted in one second windows
+struct ProcessRate {
+    ProcessRate() : window_(0), count_(0), last_(0) {}
+
+    time_t   window_;
+    unsigned count_;  // ops in the current window
+    unsigned last_;   // ops in the previous one
+};
+
+// Each mount, and each extra target of a mount, has a replicator of its
+// own with its own queues, memory cap and workers, so a shadow that
+// stalls only holds up the work queued for it. The table is filled in
+// by start_replication and doesn't change while the workers run.
+struct Replicator {
+    Replicator() : ready_seq_(0), queued_bytes_(0), max_bytes_(0),
+                   stopping_(false) {
+        memset(served_, 0, sizeof(served_));
+        pthread_mutex_init(&lock_, NULL);
+        pthread_cond_init(&work_cv_, NULL);
+        pthread_cond_init(&space_cv_, NULL);
+        pthread_cond_init(&idle_cv_, NULL);
+        pthread_cond_init(&done_cv_, NULL);
+        pthread_cond_init(&progress_cv_, NULL);
+    }
+
+    std::string            root_;
+    OpQueueTable           queues_;
+    std::deque<ReadyPath>  ready_[PRIO_LEVELS];
+    struct timeval         served_[PRIO_LEVELS];  // last turn of each level
+    unsigned long          ready_seq_;
+    size_t                 queued_bytes_;
+    size_t                 max_bytes_;
+    bool                   stopping_;
+    std::vector<pthread_t> workers_;
+
+    pthread_mutex_t lock_;
+    pthread_cond_t  work_cv_;
+    pthread_cond_t  space_cv_;
+    pthread_cond_t  idle_cv_;
+    pthread_cond_t  done_cv_;
+    pthread_cond_t  progress_cv_;
+};
+
+typedef std::map<std::string, Replicator*> ReplicatorTable;
+
+static ReplicatorTable          replicators_;
+static unsigned long            op_seq_  = 0;  // last op queued, on any mount
+static bool                     running_ = false;
+static std::map<pid_t, ProcessRate> rates_;
+static pthread_mutex_t          rate_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static Replicator*
+replicator(const std::string& path)
+{
+    if (! running_) {
+        return NULL;
+    }
+    ReplicatorTable::iterator iter = replicators_.find(root_dir(path.c_str()));
+    return iter == replicators_.end() ? NULL : iter->second;
+}
+
+void
+ShadowCall::apply()
+{
+    // An op resubmitted by the retry queue reports back whether it's
+    // done with, so the next one for the path can go.
+    if (shadow_offline(path_.c_str())) {
+        journal();
+        if (retry_) {
+            retry_result(path_, true);
+        }
+        return;
+    }
+
+    if (call() != -1) {
+        if (retry_) {
+            retry_result(path_, true);
+        }
+        return;
+    }
+
+    int err = errno;
+    if (retry_) {
+        retry_result(path_, ! retryable(err));
+        return;
+    }
+
+    if (! retryable(err)) {
+        return;
+    }
+
+    ShadowCall* copy = clone();
+    if (copy != NULL) {
+        retry_op(copy, true);
+    } else if (is_transport_error(err)) {
+        journal();
+    }
+}
+
+void
+ShadowCall::abandon()
+{
+    index_change(path_.c_str());
+}
+
+// Returns true if pid has been issuing ops faster than
+// BULK_OPS_PER_SEC, counting ops to all mounts.
+static bool
+bursting(pid_t pid, time_t now)
+{
+    pthread_mutex_lock(&rate_lock_);
+    ProcessRate& rate = rates_[pid];
+    if (rate.window_ != now) {
+        rate.last_   = rate.window_ == now - 1 ? rate.count_ : 0;
+        rate.window_ = now;
+        rate.count_  = 0;
+    }
+    rate.count_++;
+    bool burst = rate.count_ > BULK_OPS_PER_SEC || rate.last_ > BULK_OPS_PER_SEC;
+
+    // forget processes that have gone quiet
+    if (rates_.size() > 1024) {
+        std::map<pid_t, ProcessRate>::iterator iter;
+        for (iter = rates_.begin(); iter != rates_.end(); ) {
+            if (iter->second.window_ < now - 1) {
+                rates_.erase(iter++);
+            } else {
+                ++iter;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rate_lock_);
+    return burst;
+}
+
+static int
+classify(pid_t pid, off_t traffic, const struct timeval& now)
+{
+    if (traffic >= BULK_BYTES || (pid != 0 && bursting(pid, now.tv_sec))) {
+        return PRIO_BULK;
+    }
+    if (pid != 0 && traffic <= INTERACTIVE_BYTES) {
+        return PRIO_INTERACTIVE;
+    }
+    return PRIO_NORMAL;
+}
+
+// Puts the path in the ready queue at the level of its most urgent op.
+// Called with r->lock_ held.
+static void
+make_ready(Replicator* r, const std::string& path, OpQueue* q,
+           const struct timeval& now)
+{
+    ReadyPath entry;
+    entry.path_  = path;
+    entry.seq_   = ++r->ready_seq_;
+    entry.since_ = now;
+
+    q->ready_level_ = q->prio();
+    q->ready_seq_   = entry.seq_;
+    r->ready_[q->ready_level_].push_back(entry);
+    pthread_cond_signal(&r->work_cv_);
+}
+
+static bool
+ready_empty(const Replicator* r)
+{
+    for (int level = 0; level < PRIO_LEVELS; ++level) {
+        if (! r->ready_[level].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks the level to serve next. Called with r->lock_ held and at
+// least one level non-empty.
+static int
+pick_level(Replicator* r)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int pick = -1;
+    for (int level = 0; level < PRIO_LEVELS; ++level) {
+        // an empty level has nothing to be starved of
+        if (r->ready_[level].empty()) {
+            r->served_[level] = now;
+            continue;
+        }
+
+        long waited_ms = (now.tv_sec - r->served_[level].tv_sec) * 1000 +
+                         (now.tv_usec - r->served_[level].tv_usec) / 1000;
+        if (pick == -1) {
+            pick = level;
+        } else if (waited_ms >= AGE_MS * level) {
+            pick = level;
+            break;
+        }
+    }
+
+    r->served_[pick] = now;
+    return pick;
+}
+
+static void*
+repl_worker(void* arg)
+{
+    Replicator* r = (Replicator*)arg;
+
+    pthread_mutex_lock(&r->lock_);
+    while (1) {
+        while (ready_empty(r) && !r->stopping_) {
+            pthread_cond_wait(&r->work_cv_, &r->lock_);
+        }
+
+        if (ready_empty(r)) {
+            break; // stopping and fully drained
+        }
+        
+        int level = pick_level(r);
+        ReadyPath entry = r->ready_[level].front();
+        r->ready_[level].pop_front();
+
+        OpQueueTable::iterator iter = r->queues_.find(entry.path_);
+        if (iter == r->queues_.end() || iter->second.ready_seq_ != entry.seq_) {
+            continue; // superseded by an entry at a better level
+        }
+
+        std::string path = entry.path_;
+        OpQueue& q = iter->second;
+        ShadowOp* op = q.ops_.front();
+        q.ops_.pop_front();
+        q.count_[op->prio_]--;
+        q.busy_ = true;
+        q.busy_seq_ = op->seq_;
+        q.ready_seq_ = 0;
+
+        pthread_mutex_unlock(&r->lock_);
+        throttle(op->path_.c_str(), 0, 1);
+        op->apply();
+        pthread_mutex_lock(&r->lock_);
+
+        q.busy_ = false;
+        r->queued_bytes_ -= op->bytes_;
+
+        // Hand the op back to its caller if it is still waiting,
+        // otherwise it's ours to delete.
+        bool owned = ! op->waiting_;
+        if (! owned) {
+            op->done_ = true;
+            pthread_cond_broadcast(&r->done_cv_);
+        }
+
+        if (q.ops_.empty()) {
+            r->queues_.erase(path);
+            pthread_cond_broadcast(&r->idle_cv_);
+        } else {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            make_ready(r, path, &q, now);
+        }
+        pthread_cond_broadcast(&r->space_cv_);
+        pthread_cond_broadcast(&r->progress_cv_);
+
+        if (owned) {
+            pthread_mutex_unlock(&r->lock_);
+            delete op;
+            pthread_mutex_lock(&r->lock_);
+        }
+    }
+    pthread_mutex_unlock(&r->lock_);
+    return NULL;
+}
+
+static void
+apply_now(ShadowOp* op)
+{
+    op->apply();
+    delete op;
+}
+
+static void
+enqueue(ShadowOp* op)
+{
+    Replicator* r = replicator(op->path_);
+    if (r == NULL) {
+        apply_now(op);
+        return;
+    }
+
+    // Ops queued from our own threads, such as the journal replay,
+    // have no calling process.
+    fuse_context* ctx = fuse_get_context();
+    pid_t pid = ctx ? ctx->pid : 0;
+    off_t traffic = op->traffic();
+    bool target = is_target_path(op->path_.c_str());
+
+    pthread_mutex_lock(&r->lock_);
+
+    // An attribute change right behind another op on the path that
+    // hasn't started yet may be folded into it. Ops that someone is
+    // waiting for, or that report back to the retry queue, stay apart.
+    OpQueueTable::iterator queued = r->queues_.find(op->path_);
+    ShadowCall* call = dynamic_cast<ShadowCall*>(op);
+    if (call != NULL && ! call->waiting_ && ! call->retry_ &&
+        queued != r->queues_.end() && ! queued->second.ops_.empty())
+    {
+        ShadowCall* tail = dynamic_cast<ShadowCall*>(queued->second.ops_.back());
+        if (tail != NULL && ! tail->retry_ && tail->absorb(call)) {
+            dsyslog("replicate: merged op into the one queued for %s\n",
+                    op->path_.c_str());
+            pthread_mutex_unlock(&r->lock_);
+            delete op;
+            return;
+        }
+    }
+
+    // Apply backpressure once the queue hits its memory cap. An op
+    // that is larger than the whole cap is still let through once the
+    // queue is empty so that the writer can't be stuck forever. Extra
+    // targets are never waited for; they're kept to their cap by
+    // replicate_targets_write instead.
+    while (! target && r->queued_bytes_ != 0 &&
+           r->queued_bytes_ + op->bytes_ > r->max_bytes_)
+    {
+        dsyslog("replicate: queue for %s full (%zu bytes), waiting\n",
+                r->root_.c_str(), r->queued_bytes_);
+        pthread_cond_wait(&r->space_cv_, &r->lock_);
+    }
+    r->queued_bytes_ += op->bytes_;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    op->prio_ = classify(pid, traffic, now);
+    op->seq_  = __sync_add_and_fetch(&op_seq_, 1);
+
+    // A path that is already waiting is moved up if the new op is more
+    // urgent than anything it has queued.
+    OpQueue& q = r->queues_[op->path_];
+    bool idle = q.ops_.empty() && !q.busy_;
+    q.ops_.push_back(op);
+    q.count_[op->prio_]++;
+    if (idle || (q.ready_seq_ != 0 && op->prio_ < q.ready_level_)) {
+        make_ready(r, op->path_, &q, now);
+    }
+
+    pthread_mutex_unlock(&r->lock_);
+}
+
+void
+replicate_op(ShadowOp* op)
+{
+    enqueue(op);
+}
+
+// Queues the op and waits for it to be applied, but for no longer than
+// the configured deadline. Time the mount's ops spend sleeping off its
+// shadow_kbps and shadow_ops limits meanwhile extends the deadline, as
+// that's shadowfs holding them back rather than the shadow being slow.
+// Returns true if the op completed, in which case the caller owns it
+// again. On a timeout the op is left to finish
+// in the background, and the mount is taken offline so that further
+// ops go to the journal rather than pile up behind the stalled one.
+bool
+replicate_wait(ShadowOp* op)
+{
+    Replicator* r = replicator(op->path_);
+    if (r == NULL) {
+        op->apply();
+        return true;
+    }
+
+    std::string path = op->path_; // the op may be gone after a timeout
+    unsigned long throttled = throttled_ms(path.c_str());
+    op->waiting_ = true;
+    enqueue(op);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    
+    struct timespec deadline;
+    long nsec = now.tv_usec * 1000 + (_config.deadline_ms_ % 1000) * 1000000L;
+    deadline.tv_sec  = now.tv_sec + _config.deadline_ms_ / 1000 + nsec / 1000000000;
+    deadline.tv_nsec = nsec % 1000000000;
+
+    pthread_mutex_lock(&r->lock_);
+    while (! op->done_) {
+        if (_config.deadline_ms_ == 0) {
+            pthread_cond_wait(&r->done_cv_, &r->lock_);
+        } else if (pthread_cond_timedwait(&r->done_cv_, &r->lock_,
+                                          &deadline) == ETIMEDOUT)
+        {
+            unsigned long now_throttled = throttled_ms(path.c_str());
+            if (now_throttled == throttled) {
+                break;
+            }
+            long extra = now_throttled - throttled;
+            throttled = now_throttled;
+            nsec = deadline.tv_nsec + (extra % 1000) * 1000000L;
+            deadline.tv_sec += extra / 1000 + nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+        }
+    }
+
+    bool done = op->done_;
+    if (! done) {
+        op->waiting_ = false;
+    }
+    pthread_mutex_unlock(&r->lock_);
+
+    if (! done) {
+        syslog(LOG_ERR, "shadow op on %s timed out after %u ms\n",
+               path.c_str(), _config.deadline_ms_);
+        trip_mount(path.c_str(), "shadow op timed out");
+    }
+    return done;
+}
+
+
+static bool
+queued_before(const ShadowOp* a, const ShadowOp* b)
+{
+    return a->seq_ < b->seq_;
+}
+
+// Journals the ops a mount still has queued once it has gone offline,
+// in the order they were queued, since divert sends new ops straight
+// to the journal from then on. Only a run of shadow calls at the head
+// of a queue is taken: other ops, such as closing a shadow fd, still
+// have to be applied, and a path with an op in flight keeps its queue
+// for divert to line up behind (see has_queue).
+static void
+replicate_tripped(const char* path)
+{
+    Replicator* r = replicator(path);
+    if (r == NULL) {
+        return;
+    }
+
+    std::vector<ShadowOp*> ops;
+    std::vector<ShadowOp*> owned;
+
+    pthread_mutex_lock(&r->lock_);
+    OpQueueTable::iterator iter;
+    for (iter = r->queues_.begin(); iter != r->queues_.end(); ) {
+        OpQueue& q = iter->second;
+        while (! q.busy_ && ! q.ops_.empty()) {
+            ShadowCall* call = dynamic_cast<ShadowCall*>(q.ops_.front());
+            if (call == NULL || call->retry_) {
+                break;  // retried ops report back through the retry queue
+            }
+            q.ops_.pop_front();
+            q.count_[call->prio_]--;
+            r->queued_bytes_ -= call->bytes_;
+            ops.push_back(call);
+        }
+        if (q.ops_.empty() && ! q.busy_) {
+            r->queues_.erase(iter++);  // leaves a stale ready entry
+        } else {
+            ++iter;
+        }
+    }
+
+    std::sort(ops.begin(), ops.end(), queued_before);
+    for (size_t i = 0; i < ops.size(); ++i) {
+        static_cast<ShadowCall*>(ops[i])->journal();
+        if (ops[i]->waiting_) {
+            ops[i]->done_ = true;
+        } else {
+            owned.push_back(ops[i]);
+        }
+    }
+
+    if (! ops.empty()) {
+        pthread_cond_broadcast(&r->done_cv_);
+        pthread_cond_broadcast(&r->idle_cv_);
+        pthread_cond_broadcast(&r->space_cv_);
+        pthread_cond_broadcast(&r->progress_cv_);
+    }
+    pthread_mutex_unlock(&r->lock_);
+
+    if (! ops.empty()) {
+        syslog(LOG_NOTICE, "journaled %zu ops queued for %s\n",
+               ops.size(), r->root_.c_str());
+    }
+    for (size_t i = 0; i < owned.size(); ++i) {
+        delete owned[i];
+    }
+}
+
+// Whether ops for path are queued or being applied
+static bool
+has_queue(const std::string& path)
+{
+    Replicator* r = replicator(path);
+    if (r == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&r->lock_);
+    bool queued = r->queues_.find(path) != r->queues_.end();
+    pthread_mutex_unlock(&r->lock_);
+    return queued;
+}
+
+// Hands a shadow call to the retry queue, the journal or the
+// replication queue, as the state of its target calls for. Returns
+// false if it was queued for the workers.
+static bool
+divert(ShadowCall* op)
+{
+    // Queue behind any earlier ops for the path still being retried
+    // so the shadow sees them in order.
+    if (retry_pending(op->path_.c_str())) {
+        retry_op(op, false);
+        return true;
+    }
+    
+    if (shadow_offline(op->path_.c_str())) {
+        // Ops still queued for the path journal themselves when a
+        // worker gets to them, so this one has to go after them. No one
+        // waits for it, as it goes nowhere but the journal.
+        if (has_queue(op->path_)) {
+            enqueue(op);
+            return true;
+        }
+        op->journal();
+        delete op;
+        return true;
+    }
+    return false;
+}
+
+static const std::vector<std::string>&
+targets_of(const char* path)
+{
+    static const std::vector<std::string> none;
+    MountTable::const_iterator iter = _mtab.find(root_dir(path));
+    return iter == _mtab.end() ? none : iter->second.targets_;
+}
+
+// Sends a copy of a shadow call to each of the mount's extra targets.
+// Nobody waits for those, so a slow target holds up neither the caller
+// nor the other targets.
+static void
+fan_out(const ShadowCall* op)
+{
+    const std::vector<std::string>& targets = targets_of(op->path_.c_str());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        ShadowCall* copy = op->clone();
+        if (copy == NULL) {
+            return;
+        }
+        copy->retarget(targets[i]);
+        if (! divert(copy)) {
+            enqueue(copy);
+        }
+    }
+}
+
+void
+replicate_call(ShadowCall* op)
+{
+    fan_out(op);
+
+    if (! divert(op) && replicate_wait(op)) {
+        delete op;
+    }
+}
+
+// Like replicate_call, but without waiting for the shadow
+void
+replicate_async(ShadowCall* op)
+{
+    fan_out(op);
+
+    if (! divert(op)) {
+        enqueue(op);
+    }
+}
+
+// Whether an extra target has fallen so far behind that its writes
+// should go to the journal rather than pile up in memory.
+static bool
+lagging(const std::string& root)
+{
+    ReplicatorTable::iterator iter = replicators_.find(root);
+    if (! running_ || iter == replicators_.end()) {
+        return false;
+    }
+
+    Replicator* r = iter->second;
+    pthread_mutex_lock(&r->lock_);
+    size_t bytes = r->queued_bytes_;
+    pthread_mutex_unlock(&r->lock_);
+
+    if (bytes < r->max_bytes_) {
+        return false;
+    }
+    syslog(LOG_NOTICE, "target %s is %zu MB behind, journaling its writes\n",
+           root.c_str(), bytes >> 20);
+    return true;
+}
+
+void
+replicate_targets_open(const char* path, int flags, mode_t mode, bool create,
+                       uid_t uid, gid_t gid)
+{
+    const std::vector<std::string>& targets = targets_of(path);
+    for (size_t i = 0; i < targets.size(); ++i) {
+        ShadowCall* op = new TargetOpenOp(target_path(path, targets[i]),
+                                          flags, mode, create, uid, gid);
+        if (! divert(op)) {
+            enqueue(op);
+        }
+    }
+}
+
+void
+replicate_targets_write(const char* path, const char* buf, size_t size,
+                        off_t offset)
+{
+    const std::vector<std::string>& targets = targets_of(path);
+    WriteBuffer* data = NULL;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        std::string tpath = target_path(path, targets[i]);
+        if (shadow_offline(tpath.c_str()) || lagging(targets[i])) {
+            journal_record(J_WRITE, tpath.c_str(), "", offset, size);
+            continue;
+        }
+        if (data == NULL) {
+            data = new WriteBuffer(buf, size);
+        }
+        enqueue(new TargetWriteOp(tpath, data, offset));
+    }
+    if (data != NULL) {
+        data->release();
+    }
+}
+
+void
+replicate_targets_close(const char* path)
+{
+    const std::vector<std::string>& targets = targets_of(path);
+    for (size_t i = 0; i < targets.size(); ++i) {
+        enqueue(new TargetCloseOp(target_path(path, targets[i])));
+    }
+}
+
+static void
+apply_or_wait(ShadowOp* op)
+{
+    if (_config.write_behind_) {
+        enqueue(op);
+    } else if (replicate_wait(op)) {
+        delete op;
+    }
+}
+
+void
+replicate_write(const std::string& path, int fd, const char* buf,
+                size_t size, off_t offset)
+{
+    apply_or_wait(new WriteOp(path, fd, buf, size, offset));
+}
+
+void
+replicate_extents(const std::string& path, int local_fd, int shadow_fd,
+                  const ExtentSet& dirty)
+{
+    int fd = dup(local_fd);
+    if (fd == -1) {
+        syslog(LOG_ERR, "error in dup(%d): %s\n", local_fd, strerror(errno));
+        ExtentSet::ExtentMap::const_iterator iter;
+        for (iter = dirty.extents_.begin(); iter != dirty.extents_.end(); ++iter) {
+            journal_record(J_WRITE, path.c_str(), "", iter->first,
+                           iter->second - iter->first);
+        }
+        return;
+    }
+    
+    apply_or_wait(new ExtentsOp(path, fd, shadow_fd, dirty));
+}
+
+void
+replicate_close(const std::string& path, int fd)
+{
+    apply_or_wait(new CloseOp(path, fd));
+}
+
+
+void
+replicate_flush(const std::string& path)
+{
+    Replicator* r = replicator(path);
+    if (r == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock_);
+    while (r->queues_.find(path) != r->queues_.end()) {
+        pthread_cond_wait(&r->idle_cv_, &r->lock_);
+    }
+    pthread_mutex_unlock(&r->lock_);
+}
+
+// Returns a mark for the ops queued so far, to wait for with
+// replicate_barrier.
+unsigned long
+replicate_mark()
+{
+    return __sync_add_and_fetch(&op_seq_, 0);
+}
+
+// Checks whether every op queued up to mark for a path at or below
+// dir has been applied, waiting up to wait_ms for that to happen.
+// Ops queued later don't hold it up, so a barrier can't be starved by
+// new traffic.
+bool
+replicate_barrier(const std::string& dir, unsigned long mark, unsigned wait_ms)
+{
+    Replicator* r = replicator(dir);
+    if (r == NULL) {
+        return true;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    long nsec = now.tv_usec * 1000 + (wait_ms % 1000) * 1000000L;
+    deadline.tv_sec  = now.tv_sec + wait_ms / 1000 + nsec / 1000000000;
+    deadline.tv_nsec = nsec % 1000000000;
+
+    pthread_mutex_lock(&r->lock_);
+    bool caught_up;
+    while (1) {
+        // the queues are keyed by path, so the subtree is one range
+        caught_up = true;
+        OpQueueTable::iterator iter = r->queues_.lower_bound(dir);
+        for (; iter != r->queues_.end() &&
+                 iter->first.compare(0, dir.size(), dir) == 0; ++iter)
+        {
+            const std::string& path = iter->first;
+            const OpQueue& q = iter->second;
+            if (path.size() > dir.size() && path[dir.size()] != '/') {
+                continue;
+            }
+            if ((q.busy_ && q.busy_seq_ <= mark) ||
+                (! q.ops_.empty() && q.ops_.front()->seq_ <= mark))
+            {
+                caught_up = false;
+                break;
+            }
+        }
+
+        if (caught_up ||
+            pthread_cond_timedwait(&r->progress_cv_, &r->lock_,
+                                   &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&r->lock_);
+    return caught_up;
+}
+
+void
+start_replication()
+{
+    size_t max_bytes = (size_t)_config.repl_queue_mb_ << 20;
+    unsigned nthreads = _config.repl_threads_ ? _config.repl_threads_ : 1;
+
+    syslog(LOG_NOTICE, "starting %u replication workers per mount "
+           "(queue limit %u MB)\n", nthreads, _config.repl_queue_mb_);
+
+    MountTable::iterator iter;
+    for (iter = _mtab.begin(); iter != _mtab.end(); ++iter) {
+        Replicator* r = new Replicator();
+        r->root_      = iter->first;
+        r->max_bytes_ = max_bytes;
+
+        for (unsigned i = 0; i < nthreads; ++i) {
+            pthread_t tid;
+            int err = pthread_create(&tid, NULL, repl_worker, r);
+            if (err != 0) {
+                syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+                break;
+            }
+            r->workers_.push_back(tid);
+        }
+
+        // without workers, the mount's ops are applied by the caller
+        if (r->workers_.empty()) {
+            delete r;
+        } else {
+            replicators_[iter->first] = r;
+        }
+    }
+
+    running_ = !replicators_.empty();
+    _on_trip = replicate_tripped;
+}
+
+void
+stop_replication()
+{
+    if (! running_) {
+        return;
+    }
+
+    ReplicatorTable::iterator iter;
+    for (iter = replicators_.begin(); iter != replicators_.end(); ++iter) {
+        Replicator* r = iter->second;
+        pthread_mutex_lock(&r->lock_);
+        r->stopping_ = true;
+        pthread_cond_broadcast(&r->work_cv_);
+        pthread_mutex_unlock(&r->lock_);
+    }
+
+    for (iter = replicators_.begin(); iter != replicators_.end(); ++iter) {
+        Replicator* r = iter->second;
+        for (size_t i = 0; i < r->workers_.size(); ++i) {
+            pthread_join(r->workers_[i], NULL);
+        }
+    }
+    running_ = false;
+
+    for (iter = replicators_.begin(); iter != replicators_.end(); ++iter) {
+        delete iter->second;
+    }
+    replicators_.clear();
+}
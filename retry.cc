@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+// Shadow calls that fail are kept here, per path, and retried with
+// exponential backoff. While a path has ops waiting to be retried, any
+// new op for it is queued behind them so the shadow sees the changes
+// in order, and an op that makes earlier ones moot (e.g. a second
+// chmod, or an unlink) replaces them.
+
+#define RETRY_MIN_MS   100
+#define RETRY_MAX_MS   30000
+#define RETRY_ATTEMPTS 10
+
+struct RetryQueue {
+    RetryQueue() : attempts_(0), inflight_(false) {
+        next_.tv_sec  = 0;
+        next_.tv_usec = 0;
+    }
+
+    std::deque<ShadowCall*> ops_;
+    unsigned                attempts_;  // failed attempts of the head op
+    bool                    inflight_;  // the head op is being retried
+    struct timeval          next_;      // when the head op is due
+};
+
+typedef std::map<std::string, RetryQueue> RetryTable;
+
+static RetryTable      retries_;
+static pthread_t       retrier_;
+static bool            retrier_running_ = false;
+static pthread_mutex_t retry_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  retry_cv_   = PTHREAD_COND_INITIALIZER;
+
+static void
+schedule(RetryQueue* q, unsigned delay_ms)
+{
+    gettimeofday(&q->next_, NULL);
+    q->next_.tv_sec  += delay_ms / 1000;
+    q->next_.tv_usec += (delay_ms % 1000) * 1000;
+    if (q->next_.tv_usec >= 1000000) {
+        q->next_.tv_sec  += 1;
+        q->next_.tv_usec -= 1000000;
+    }
+}
+
+bool
+retry_pending(const char* path)
+{
+    pthread_mutex_lock(&retry_lock_);
+    bool pending = retries_.find(path) != retries_.end();
+    pthread_mutex_unlock(&retry_lock_);
+    return pending;
+}
+
+// Whether any path at or below dir has ops waiting to be retried
+bool
+retry_pending_under(const std::string& dir)
+{
+    bool pending = false;
+    pthread_mutex_lock(&retry_lock_);
+    RetryTable::iterator iter = retries_.lower_bound(dir);
+    for (; iter != retries_.end() &&
+             iter->first.compare(0, dir.size(), dir) == 0; ++iter)
+    {
+        if (iter->first.size() == dir.size() || iter->first[dir.size()] == '/') {
+            pending = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&retry_lock_);
+    return pending;
+}
+
+void
+retry_op(ShadowCall* op, bool failed)
+{
+    op->waiting_ = false;
+    op->done_    = false;
+    op->retry_   = false;
+
+    pthread_mutex_lock(&retry_lock_);
+    RetryQueue& q = retries_[op->path_];
+
+    // Drop queued ops that this one supersedes, but never the head if
+    // it's currently being retried.
+    std::deque<ShadowCall*>::iterator iter = q.ops_.begin();
+    if (q.inflight_ && iter != q.ops_.end()) {
+        ++iter;
+    }
+    while (iter != q.ops_.end()) {
+        if (op->supersedes(*iter)) {
+            dsyslog("retry: dropping superseded op on %s\n", op->path_.c_str());
+            delete *iter;
+            iter = q.ops_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+
+    if (q.ops_.empty() && ! q.inflight_) {
+        q.attempts_ = failed ? 1 : 0;
+        schedule(&q, failed ? RETRY_MIN_MS : 0);
+    }
+    q.ops_.push_back(op);
+    
+    pthread_cond_signal(&retry_cv_);
+    pthread_mutex_unlock(&retry_lock_);
+}
+
+void
+retry_result(const std::string& path, bool done)
+{
+    pthread_mutex_lock(&retry_lock_);
+    RetryTable::iterator iter = retries_.find(path);
+    if (iter == retries_.end()) {
+        pthread_mutex_unlock(&retry_lock_);
+        return;
+    }
+
+    RetryQueue& q = iter->second;
+    q.inflight_ = false;
+
+    bool give_up = ! done && q.attempts_ + 1 >= RETRY_ATTEMPTS;
+    if (give_up) {
+        syslog(LOG_ERR, "giving up on shadow op for %s after %u attempts, "
+               "leaving it to reconcile\n", path.c_str(), q.attempts_ + 1);
+    }
+
+    ShadowCall* finished = NULL;
+    if (done || give_up) {
+        if (! q.ops_.empty()) {
+            finished = q.ops_.front();
+            q.ops_.pop_front();
+        }
+        q.attempts_ = 0;
+        schedule(&q, 0);
+    } else {
+        q.attempts_++;
+        unsigned delay = RETRY_MIN_MS << std::min(q.attempts_, 16U);
+        schedule(&q, std::min(delay, (unsigned)RETRY_MAX_MS));
+        dsyslog("retry: %s failed %u times, next attempt in %u ms\n",
+                path.c_str(), q.attempts_, std::min(delay, (unsigned)RETRY_MAX_MS));
+    }
+
+    if (q.ops_.empty()) {
+        retries_.erase(iter);
+    }
+
+    pthread_cond_signal(&retry_cv_);
+    pthread_mutex_unlock(&retry_lock_);
+
+    if (give_up && finished != NULL) {
+        finished->abandon();
+    }
+    delete finished;
+}
+
+static void*
+retrier(void*)
+{
+    pthread_mutex_lock(&retry_lock_);
+    while (retrier_running_) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        // Resubmit the head op of every queue that is due, and find
+        // out when the next one will be.
+        struct timeval next = now;
+        next.tv_sec += 1;
+        
+        std::vector<ShadowCall*> due;
+        RetryTable::iterator iter;
+        for (iter = retries_.begin(); iter != retries_.end(); ++iter) {
+            RetryQueue& q = iter->second;
+            if (q.inflight_) {
+                continue;
+            }
+
+            if (timercmp(&q.next_, &now, <=)) {
+                ShadowCall* op = q.ops_.front()->clone();
+                op->retry_ = true;
+                q.inflight_ = true;
+                due.push_back(op);
+            } else if (timercmp(&q.next_, &next, <)) {
+                next = q.next_;
+            }
+        }
+
+        // The ops report back through retry_result, possibly from
+        // this thread if the queue applies them inline.
+        if (! due.empty()) {
+            pthread_mutex_unlock(&retry_lock_);
+            for (size_t i = 0; i < due.size(); ++i) {
+                replicate_op(due[i]);
+            }
+            pthread_mutex_lock(&retry_lock_);
+            continue;
+        }
+
+        struct timespec deadline;
+        deadline.tv_sec  = next.tv_sec;
+        deadline.tv_nsec = next.tv_usec * 1000;
+        pthread_cond_timedwait(&retry_cv_, &retry_lock_, &deadline);
+    }
+    pthread_mutex_unlock(&retry_lock_);
+    return NULL;
+}
+
+void
+start_retry()
+{
+    retrier_running_ = true;
+    int err = pthread_create(&retrier_, NULL, retrier, NULL);
+    if (err != 0) {
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        retrier_running_ = false;
+    }
+}
+
+void
+stop_retry()
+{
+    if (retrier_running_) {
+        pthread_mutex_lock(&retry_lock_);
+        retrier_running_ = false;
+        pthread_cond_signal(&retry_cv_);
+        pthread_mutex_unlock(&retry_lock_);
+        pthread_join(retrier_, NULL);
+    }
+
+    RetryTable::iterator iter;
+    for (iter = retries_.begin(); iter != retries_.end(); ++iter) {
+        syslog(LOG_ERR, "dropping %zu shadow ops for %s pending retry\n",
+               iter->second.ops_.size(), iter->first.c_str());
+        for (size_t i = 0; i < iter->second.ops_.size(); ++i) {
+            delete iter->second.ops_[i];
+        }
+    }
+    retries_.clear();
+}
@@ -48,23 +48,28 @@ static int root_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     std::string data_path = DATA_DIR + path;
     
+    unsigned long epoch;
+    if (dir_cache_fill(path, buf, filler, &epoch)) {
+        return 0;
+    }
+
+    DirListing listing;
     dp = opendir(data_path.c_str());
     if (dp == NULL)
         return -errno;
 
     while ((de = readdir(dp)) != NULL) {
-        if (!strcmp(de->d_name, ".config"))
+        if (!strcmp(de->d_name, ".config") || !strcmp(de->d_name, ".journal") ||
+            !strcmp(de->d_name, ".localonly") || !strcmp(de->d_name, ".index") ||
+            !strcmp(de->d_name, ".throttle") || !strcmp(de->d_name, ".barrier"))
             continue;
-        
-        struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        st.st_mode = de->d_type << 12;
-        if (filler(buf, de->d_name, &st, 0))
-            break;
+
+        listing.add(de);
     }
 
     closedir(dp);
+    listing.fill(buf, filler);
+    dir_cache_put(path, &listing, epoch);
     return 0;
 }
 
@@ -4,5 +4,5 @@ mount | grep shadowfs > /dev/null
 if [ $? = 0 ] ; then
     umount /u/$USER/shadowfs
 fi
-shadowfs $* -odefault_permissions,noappledouble -s /u/$USER/shadowfs/
+shadowfs $* -odefault_permissions,noappledouble /u/$USER/shadowfs/
 
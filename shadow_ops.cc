@@ -18,16 +18,1490 @@
  */
 
 #include "shadowfs.h"
+#include <pthread.h>
+#ifdef linux
+#include <sys/fsuid.h>
+#endif
+#include <algorithm>
 #include <map>
+#include <set>
+#include <vector>
+
+struct ShadowFileState {
+    ShadowFileState() : local_fd(-1), local_readable(false), shadow_fd(-1),
+                        offline(false), open_pending(false), open_flags(0),
+                        rewrite(false), rewrite_fd(-1), targets(false),
+                        stage_offset(0), flushing(false) {
+        pthread_mutex_init(&open_lock, NULL);
+    }
+    ~ShadowFileState() {
+        if (rewrite_fd != -1) {
+            close(rewrite_fd);
+        }
+        pthread_mutex_destroy(&open_lock);
+    }
+
+    std::string path;
+    int local_fd;
+    bool local_readable;
+    int shadow_fd;
+    bool offline;
+
+    // Files opened for writing only get their shadow fd once something
+    // is actually written, see ensure_shadow.
+    bool open_pending;
+    int open_flags;
+    pthread_mutex_t open_lock;
+
+    // With stream_rewrites set, a file that is created or truncated on
+    // open is copied to the shadow as a whole once it's closed rather
+    // than write by write. rewrite_fd reads the file for those copies,
+    // which may only run after it has been renamed (see CopyFileOp).
+    bool rewrite;
+    int rewrite_fd;
+
+    // The mount's extra targets have had the file opened for writing
+    bool targets;
+
+    // Small writes are staged here and merged into a single extent
+    // before being sent to the shadow (see stage_write).
+    off_t stage_offset;
+    std::string stage;
+    struct timeval stage_time;
+
+    // With delta_ms set, writes only mark their range dirty, and the
+    // merged ranges are copied from the local file later (see
+    // mark_dirty).
+    ExtentSet dirty;
+    struct timeval dirty_time;
+
+    // Staged data or dirty extents taken out by one thread are being
+    // sent to the shadow (see ship_stage).
+    bool flushing;
+};
+
+// Open files are tracked by their fuse file handle. The table is split
+// into shards with a lock each, so that opens and releases of different
+// files don't contend under the multithreaded fuse loop.
+#define OPEN_FILE_SHARDS 16
+
+typedef std::map<uint64_t, ShadowFileState*> OpenFileTable;
+
+struct OpenFileShard {
+    OpenFileShard() { pthread_mutex_init(&lock_, NULL); }
+
+    pthread_mutex_t lock_;
+    OpenFileTable   files_;
+};
+
+static OpenFileShard open_files_[OPEN_FILE_SHARDS];
+
+static OpenFileShard*
+open_file_shard(uint64_t fh)
+{
+    // handles are heap pointers, so the low bits carry no information
+    return &open_files_[(fh >> 4) % OPEN_FILE_SHARDS];
+}
+
+static void
+add_open_file(struct fuse_file_info* fi, ShadowFileState* info)
+{
+    fi->fh = (uint64_t)info;
+
+    OpenFileShard* shard = open_file_shard(fi->fh);
+    pthread_mutex_lock(&shard->lock_);
+    shard->files_[fi->fh] = info;
+    pthread_mutex_unlock(&shard->lock_);
+}
+
+static void
+remove_open_file(struct fuse_file_info* fi)
+{
+    OpenFileShard* shard = open_file_shard(fi->fh);
+    pthread_mutex_lock(&shard->lock_);
+    int n = shard->files_.erase(fi->fh);
+    pthread_mutex_unlock(&shard->lock_);
+
+    if (n != 1) {
+        syslog(LOG_ERR, "error in release: handle %llx not in open file table\n",
+               (unsigned long long)fi->fh);
+    }
+    fi->fh = 0;
+}
+
+static void copy_file(const std::string& path, bool wait, bool in_place = false,
+                      int source_fd = -1);
+
+// Whether the shadow file of path is open through a handle other than
+// except, which a whole-file copy mustn't replace.
+static bool
+shadow_open_path(const std::string& path, ShadowFileState* except)
+{
+    bool found = false;
+    for (int i = 0; i < OPEN_FILE_SHARDS && ! found; ++i) {
+        OpenFileShard* shard = &open_files_[i];
+        pthread_mutex_lock(&shard->lock_);
+        OpenFileTable::iterator iter;
+        for (iter = shard->files_.begin(); iter != shard->files_.end(); ++iter) {
+            ShadowFileState* other = iter->second;
+            if (other == except || other->path != path) {
+                continue;
+            }
+            pthread_mutex_lock(&other->open_lock);
+            found = other->shadow_fd != -1;
+            pthread_mutex_unlock(&other->open_lock);
+            if (found) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock_);
+    }
+    return found;
+}
+
+static bool
+shadow_open_elsewhere(ShadowFileState* info)
+{
+    return shadow_open_path(info->path, info);
+}
+
+// A read-only fd on a file opened for a rewrite, taken while the path
+// still names it. -1 if the file can't be read back, in which case the
+// copies open it by path.
+static int
+rewrite_source(ShadowFileState* info, const std::string& local_path)
+{
+    if (info->local_readable) {
+        return dup(info->local_fd);
+    }
+    return open(local_path.c_str(), O_RDONLY);
+}
+
+// Another fd for a copy of info's file, see CopyFileOp
+static int
+rewrite_dup(ShadowFileState* info)
+{
+    return info->rewrite_fd == -1 ? -1 : dup(info->rewrite_fd);
+}
+
+// Copies out the rewritten contents of open files on a path that's
+// about to be renamed.
+static void
+flush_rewrites_path(const char* path)
+{
+    if (! _config.stream_rewrites_) {
+        return;
+    }
+
+    bool found = false;
+    int source_fd = -1;
+    for (int i = 0; i < OPEN_FILE_SHARDS && ! found; ++i) {
+        OpenFileShard* shard = &open_files_[i];
+        pthread_mutex_lock(&shard->lock_);
+        OpenFileTable::iterator iter;
+        for (iter = shard->files_.begin(); iter != shard->files_.end(); ++iter) {
+            if (iter->second->rewrite && iter->second->path == path) {
+                found = true;
+                source_fd = rewrite_dup(iter->second);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock_);
+    }
+
+    if (found) {
+        copy_file(path, true, false, source_fd);
+    }
+}
+
+// All staging buffers and dirty extents, as well as the set of files
+// that currently have either, are protected by stage_lock_ so that the
+// flusher thread can push out stale extents. The lock is only held to
+// take the data out of a file's buffers: sending it to the shadow can
+// block on a slow mount, so that is done once the lock is dropped (see
+// ship_stage). A file has at most one such flush in flight, which keeps
+// its writes in order, and stays in staged_files_ until the flush is
+// done so that path flushes and release wait for it.
+typedef std::set<ShadowFileState*> StagedFileSet;
+static StagedFileSet staged_files_;
+static pthread_mutex_t stage_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushed_cv_ = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flusher_cv_ = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher_;
+static bool flusher_running_ = false;
+
+// The data taken out of a file's buffers by take_stage_locked
+struct StagedFlush {
+    ShadowFileState* info_;
+    std::string stage_;
+    off_t stage_offset_;
+    ExtentSet dirty_;
+};
+typedef std::vector<StagedFlush> StagedFlushList;
+
+static void
+wait_flushed_locked(ShadowFileState* info)
+{
+    while (info->flushing) {
+        pthread_cond_wait(&flushed_cv_, &stage_lock_);
+    }
+}
+
+// Moves the staged data and dirty extents of info to flushes and marks
+// the file as being flushed. The caller must either have waited for a
+// previous flush of the file or own it.
+static void
+take_stage_locked(ShadowFileState* info, StagedFlushList* flushes)
+{
+    if (info->stage.empty() && info->dirty.empty()) {
+        return;
+    }
+
+    flushes->push_back(StagedFlush());
+    StagedFlush& flush = flushes->back();
+    flush.info_ = info;
+    flush.stage_.swap(info->stage);
+    flush.stage_offset_ = info->stage_offset;
+    flush.dirty_.extents_.swap(info->dirty.extents_);
+    info->flushing = true;
+}
+
+// Takes the data out of every staged file whose path matches, waiting
+// for flushes already in flight. The set is scanned again after each
+// change, since other files may be released while the lock is dropped.
+static void
+take_matching_locked(bool (*match)(const std::string&, const std::string&),
+                     const std::string& arg, StagedFlushList* flushes)
+{
+    std::set<ShadowFileState*> taken;
+    bool again = true;
+    while (again) {
+        again = false;
+        StagedFileSet::iterator iter;
+        for (iter = staged_files_.begin(); iter != staged_files_.end(); ++iter) {
+            ShadowFileState* info = *iter;
+            if (taken.count(info) || ! match(info->path, arg)) {
+                continue;
+            }
+            if (info->flushing) {
+                pthread_cond_wait(&flushed_cv_, &stage_lock_);
+            } else if (info->stage.empty() && info->dirty.empty()) {
+                staged_files_.erase(info);
+            } else {
+                take_stage_locked(info, flushes);
+                taken.insert(info);
+            }
+            again = true;
+            break;
+        }
+    }
+}
+
+// Sends the taken data on its way, or to the journal if the shadow is
+// offline, then lets the files be flushed again. Called without
+// stage_lock_ held.
+static void
+ship_stage(StagedFlushList* flushes)
+{
+    if (flushes->empty()) {
+        return;
+    }
+
+    StagedFlushList::iterator iter;
+    for (iter = flushes->begin(); iter != flushes->end(); ++iter) {
+        ShadowFileState* info = iter->info_;
+        bool offline = shadow_offline(info->path.c_str());
+
+        if (! iter->dirty_.empty()) {
+            dsyslog("shipping %zu dirty extents for %s\n",
+                    iter->dirty_.extents_.size(), info->path.c_str());
+
+            if (offline) {
+                ExtentSet::ExtentMap::const_iterator extent;
+                for (extent = iter->dirty_.extents_.begin();
+                     extent != iter->dirty_.extents_.end(); ++extent)
+                {
+                    journal_record(J_WRITE, info->path.c_str(), "",
+                                   extent->first, extent->second - extent->first);
+                }
+            } else {
+                replicate_extents(info->path, info->local_fd, info->shadow_fd,
+                                  iter->dirty_);
+            }
+        }
+
+        if (! iter->stage_.empty()) {
+            dsyslog("flushing %zu staged bytes at %llu for %s\n",
+                    iter->stage_.size(),
+                    static_cast<unsigned long long>(iter->stage_offset_),
+                    info->path.c_str());
+
+            if (offline) {
+                journal_record(J_WRITE, info->path.c_str(), "",
+                               iter->stage_offset_, iter->stage_.size());
+            } else {
+                replicate_write(info->path, info->shadow_fd, iter->stage_.data(),
+                                iter->stage_.size(), iter->stage_offset_);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&stage_lock_);
+    for (iter = flushes->begin(); iter != flushes->end(); ++iter) {
+        ShadowFileState* info = iter->info_;
+        info->flushing = false;
+        if (info->stage.empty() && info->dirty.empty()) {
+            staged_files_.erase(info);
+        }
+    }
+    pthread_cond_broadcast(&flushed_cv_);
+    pthread_mutex_unlock(&stage_lock_);
+}
+
+static void
+flush_stage(ShadowFileState* info)
+{
+    StagedFlushList flushes;
+    pthread_mutex_lock(&stage_lock_);
+    wait_flushed_locked(info);
+    take_stage_locked(info, &flushes);
+    if (flushes.empty()) {
+        staged_files_.erase(info);
+    }
+    pthread_mutex_unlock(&stage_lock_);
+    ship_stage(&flushes);
+}
+
+static bool
+path_equal(const std::string& path, const std::string& other)
+{
+    return path == other;
+}
+
+// Flush staged data for all open files on the given path, used before
+// path-based operations that need to be ordered after the writes.
+static void
+flush_stage_path(const char* path)
+{
+    StagedFlushList flushes;
+    pthread_mutex_lock(&stage_lock_);
+    take_matching_locked(path_equal, path, &flushes);
+    pthread_mutex_unlock(&stage_lock_);
+    ship_stage(&flushes);
+}
+
+// Records a write as a dirty range of the file, to be copied to the
+// shadow on fsync or close, or once delta_ms has passed. A file that
+// is rewritten in place many times over then costs a few large copies.
+static void
+mark_dirty(ShadowFileState* info, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&stage_lock_);
+    if (info->dirty.empty()) {
+        gettimeofday(&info->dirty_time, NULL);
+        staged_files_.insert(info);
+    }
+    info->dirty.add(offset, size);
+    pthread_mutex_unlock(&stage_lock_);
+}
+
+static void
+stage_write(ShadowFileState* info, const char* buf, size_t size, off_t offset)
+{
+    size_t limit = (size_t)_config.coalesce_kb_ << 10;
+    
+    if (limit == 0) {
+        replicate_write(info->path, info->shadow_fd, buf, size, offset);
+        return;
+    }
+
+    StagedFlushList flushes;
+    pthread_mutex_lock(&stage_lock_);
+    wait_flushed_locked(info);
+
+    if (size >= limit && info->stage.empty()) {
+        pthread_mutex_unlock(&stage_lock_);
+        replicate_write(info->path, info->shadow_fd, buf, size, offset);
+        return;
+    }
+
+    // Only contiguous or overlapping writes can be merged into the
+    // staged extent, anything else pushes the current one out first.
+    if (! info->stage.empty()) {
+        off_t stage_end = info->stage_offset + info->stage.size();
+        if (offset > stage_end || offset + (off_t)size < info->stage_offset) {
+            take_stage_locked(info, &flushes);
+        }
+    }
+
+    if (info->stage.empty()) {
+        info->stage.reserve(limit);
+        info->stage.assign(buf, size);
+        info->stage_offset = offset;
+        gettimeofday(&info->stage_time, NULL);
+        staged_files_.insert(info);
+    } else {
+        if (offset < info->stage_offset) {
+            info->stage.insert((size_t)0, info->stage_offset - offset, '\0');
+            info->stage_offset = offset;
+        }
+        
+        size_t pos = offset - info->stage_offset;
+        if (pos + size > info->stage.size()) {
+            info->stage.resize(pos + size);
+        }
+        info->stage.replace(pos, size, buf, size);
+    }
+
+    if (info->stage.size() >= limit) {
+        take_stage_locked(info, &flushes);
+    }
+
+    pthread_mutex_unlock(&stage_lock_);
+    ship_stage(&flushes);
+}
+
+// Newly created files are kept off the shadow for settle_ms, since
+// most temporary files are renamed over their target or removed well
+// within that. Until the window closes, writes and attribute changes
+// to the file only happen locally. A rename then becomes a single copy
+// of the whole file to its final name, and an unlink means the shadow
+// never hears about the file at all.
+typedef std::map<std::string, struct timeval> SettleTable;
+static SettleTable settling_;
+static pthread_mutex_t settle_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+settle_start(const char* path)
+{
+    if (_config.settle_ms_ == 0 || shadow_offline(path)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&settle_lock_);
+    gettimeofday(&settling_[path], NULL);
+    pthread_mutex_unlock(&settle_lock_);
+    return true;
+}
+
+static bool
+is_settling(const char* path)
+{
+    if (_config.settle_ms_ == 0) {
+        return false;
+    }
+    
+    pthread_mutex_lock(&settle_lock_);
+    bool settling = settling_.find(path) != settling_.end();
+    pthread_mutex_unlock(&settle_lock_);
+    return settling;
+}
+
+// Forgets about a settling file, returning whether it was one.
+static bool
+settle_drop(const char* path)
+{
+    if (_config.settle_ms_ == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&settle_lock_);
+    bool settling = settling_.erase(path) != 0;
+    pthread_mutex_unlock(&settle_lock_);
+    return settling;
+}
+
+// Closes the window of a settling file early, for operations that
+// have to be applied to the shadow copy of the file.
+static void
+settle_now(const char* path)
+{
+    if (settle_drop(path)) {
+        copy_file(path, true);
+    }
+}
+
+// Closes the window of all settling files below a directory that's
+// about to be renamed, so they move along with it.
+static void
+settle_under(const char* dir)
+{
+    if (_config.settle_ms_ == 0) {
+        return;
+    }
+
+    std::string prefix = std::string(dir) + "/";
+    std::vector<std::string> paths;
+
+    pthread_mutex_lock(&settle_lock_);
+    SettleTable::iterator iter = settling_.lower_bound(prefix);
+    while (iter != settling_.end() &&
+           iter->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        paths.push_back(iter->first);
+        settling_.erase(iter++);
+    }
+    pthread_mutex_unlock(&settle_lock_);
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        copy_file(paths[i], true);
+    }
+}
+
+// Copies out the files whose window has closed, or all of them if now
+// is NULL.
+static void
+settle_expired(const struct timeval* now)
+{
+    std::vector<std::string> paths;
+
+    pthread_mutex_lock(&settle_lock_);
+    SettleTable::iterator iter = settling_.begin();
+    while (iter != settling_.end()) {
+        if (now == NULL ||
+            (now->tv_sec - iter->second.tv_sec) * 1000 +
+            (now->tv_usec - iter->second.tv_usec) / 1000 >= (long)_config.settle_ms_)
+        {
+            paths.push_back(iter->first);
+            settling_.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+    pthread_mutex_unlock(&settle_lock_);
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        dsyslog("settle window of %s closed\n", paths[i].c_str());
+        copy_file(paths[i], false);
+    }
+}
+
+static void*
+stage_flusher(void*)
+{
+    // wake up often enough for whichever of the timers is shortest
+    long interval_ms = 1000;
+    if (_config.coalesce_kb_ != 0) {
+        interval_ms = std::max(_config.coalesce_ms_, 1U);
+    }
+    if (_config.settle_ms_ != 0) {
+        interval_ms = std::min(interval_ms, (long)std::max(_config.settle_ms_ / 4, 1U));
+    }
+    if (_config.delta_ms_ != 0) {
+        interval_ms = std::min(interval_ms, (long)std::max(_config.delta_ms_ / 4, 1U));
+    }
+    
+    pthread_mutex_lock(&stage_lock_);
+    while (flusher_running_) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        struct timespec deadline;
+        long nsec = now.tv_usec * 1000 + (interval_ms % 1000) * 1000000;
+        deadline.tv_sec  = now.tv_sec + interval_ms / 1000 + nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+        pthread_cond_timedwait(&flusher_cv_, &stage_lock_, &deadline);
+
+        gettimeofday(&now, NULL);
+        StagedFlushList flushes;
+        StagedFileSet::iterator iter;
+        for (iter = staged_files_.begin(); iter != staged_files_.end(); ++iter) {
+            ShadowFileState* info = *iter;
+            if (info->flushing) {
+                continue;
+            }
+            long age_ms = (now.tv_sec - info->stage_time.tv_sec) * 1000 +
+                          (now.tv_usec - info->stage_time.tv_usec) / 1000;
+            long dirty_ms = (now.tv_sec - info->dirty_time.tv_sec) * 1000 +
+                            (now.tv_usec - info->dirty_time.tv_usec) / 1000;
+            if ((! info->stage.empty() && age_ms >= (long)_config.coalesce_ms_) ||
+                (! info->dirty.empty() && dirty_ms >= (long)_config.delta_ms_))
+            {
+                take_stage_locked(info, &flushes);
+            }
+        }
+        pthread_mutex_unlock(&stage_lock_);
+
+        ship_stage(&flushes);
+        if (_config.settle_ms_ != 0) {
+            settle_expired(&now);
+        }
+
+        pthread_mutex_lock(&stage_lock_);
+    }
+    pthread_mutex_unlock(&stage_lock_);
+    return NULL;
+}
+
+ShadowCreds::ShadowCreds(uid_t uid, gid_t gid) : active_(false)
+{
+#ifdef linux
+    if (geteuid() != 0) {
+        return;
+    }
+
+    old_gid_ = setfsgid(gid);
+    old_uid_ = setfsuid(uid);
+
+    // neither call reports errors, so check that they took
+    active_ = (uid_t)setfsuid(-1) == uid && (gid_t)setfsgid(-1) == gid;
+    if (! active_) {
+        setfsuid(old_uid_);
+        setfsgid(old_gid_);
+    }
+#endif
+}
+
+ShadowCreds::~ShadowCreds()
+{
+#ifdef linux
+    if (active_) {
+        int err = errno;
+        setfsuid(old_uid_);
+        setfsgid(old_gid_);
+        errno = err;
+    }
+#endif
+}
+
+// Shadow-side operations. These run on the replication workers so a
+// stalled shadow can hold up the calling FUSE thread for at most the
+// configured deadline (see replicate_call).
+
+// Attribute changes to a shadow path. Changes to a path that are
+// queued one after the other are merged into one update (see
+// ShadowCall::absorb), the later one winning for each attribute.
+struct ShadowAttrs {
+    enum { MODE = 1, OWNER = 2, TIMES = 4 };
+
+    ShadowAttrs() : set_(0), mode_(0), uid_(-1), gid_(-1) {}
+
+    void set_mode(mode_t mode) {
+        set_ |= MODE;
+        mode_ = mode;
+    }
+
+    // -1 leaves the uid or gid as it is, as for chown
+    void set_owner(uid_t uid, gid_t gid) {
+        if (! (set_ & OWNER)) {
+            uid_ = -1;
+            gid_ = -1;
+        }
+        set_ |= OWNER;
+        if (uid != (uid_t)-1) {
+            uid_ = uid;
+        }
+        if (gid != (gid_t)-1) {
+            gid_ = gid;
+        }
+    }
+
+    void set_times(const struct timespec ts[2]) {
+        set_ |= TIMES;
+        ts_[0] = ts[0];
+        ts_[1] = ts[1];
+    }
+
+    // Whether applying these makes applying earlier moot, i.e. they
+    // set everything earlier does. A chown only covers the uid or gid
+    // of another if it sets that too.
+    bool covers(const ShadowAttrs& earlier) const {
+        if ((earlier.set_ & ~set_) != 0) {
+            return false;
+        }
+        if (earlier.set_ & OWNER) {
+            if ((earlier.uid_ != (uid_t)-1 && uid_ == (uid_t)-1) ||
+                (earlier.gid_ != (gid_t)-1 && gid_ == (gid_t)-1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Whether later can be folded into these. Merged attributes are
+    // applied owner first, so a chown that came after a chmod setting
+    // setuid or setgid bits would no longer clear them.
+    bool can_merge(const ShadowAttrs& later) const {
+        return ! ((later.set_ & OWNER) && (set_ & MODE) &&
+                  (mode_ & (S_ISUID | S_ISGID)));
+    }
+
+    void merge(const ShadowAttrs& later) {
+        if (later.set_ & MODE) {
+            set_mode(later.mode_);
+        }
+        if (later.set_ & OWNER) {
+            set_owner(later.uid_, later.gid_);
+        }
+        if (later.set_ & TIMES) {
+            set_times(later.ts_);
+        }
+    }
+
+    int apply(const char* path, const std::string& shadow_path) const;
+    void journal(const char* path) const;
+
+    unsigned        set_;  // which of the below to change
+    mode_t          mode_;
+    uid_t           uid_;
+    gid_t           gid_;
+    struct timespec ts_[2];
+};
+
+// The owner goes first, since a chown can clear the setuid bits
+int
+ShadowAttrs::apply(const char* path, const std::string& shadow_path) const
+{
+    const char* sp = shadow_path.c_str();
+
+    if ((set_ & OWNER) && SHADOW_CALL(path, lchown(sp, uid_, gid_)) == -1) {
+        syslog(LOG_ERR, "error in shadow chown(%s): %s\n", sp, strerror(errno));
+        return -1;
+    }
+    if ((set_ & MODE) && SHADOW_CALL(path, chmod(sp, mode_)) == -1) {
+        syslog(LOG_ERR, "error in shadow chmod(%s): %s\n", sp, strerror(errno));
+        return -1;
+    }
+    if (set_ & TIMES) {
+        struct timeval tv[2];
+        tv[0].tv_sec = ts_[0].tv_sec;
+        tv[0].tv_usec = ts_[0].tv_nsec / 1000;
+        tv[1].tv_sec = ts_[1].tv_sec;
+        tv[1].tv_usec = ts_[1].tv_nsec / 1000;
+
+        if (SHADOW_CALL(path, utimes(sp, tv)) == -1) {
+            syslog(LOG_ERR, "error in shadow utimes(%s): %s\n",
+                   sp, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+ShadowAttrs::journal(const char* path) const
+{
+    if (set_ & OWNER) {
+        journal_record(J_CHOWN, path, "", uid_, gid_);
+    }
+    if (set_ & MODE) {
+        journal_record(J_CHMOD, path, "", mode_);
+    }
+    if (set_ & TIMES) {
+        journal_record(J_UTIMENS, path, "", ts_[0].tv_sec, ts_[0].tv_nsec,
+                       ts_[1].tv_sec, ts_[1].tv_nsec);
+    }
+}
+
+// A chmod, chown or utimens of the shadow, or any mix of them
+struct AttrOp : public ShadowCall {
+    AttrOp(const char* path) : ShadowCall(path) {}
+
+    int call() {
+        return attrs_.apply(path_.c_str(), get_shadow_path(path_.c_str()));
+    }
+
+    void journal() {
+        attrs_.journal(path_.c_str());
+    }
+
+    ShadowCall* clone() const { return new AttrOp(*this); }
+
+    bool supersedes(const ShadowCall* op) const {
+        const AttrOp* attr = dynamic_cast<const AttrOp*>(op);
+        return attr != NULL && attrs_.covers(attr->attrs_);
+    }
+
+    bool absorb(const ShadowCall* later) {
+        const AttrOp* attr = dynamic_cast<const AttrOp*>(later);
+        if (attr == NULL || ! attrs_.can_merge(attr->attrs_)) {
+            return false;
+        }
+        attrs_.merge(attr->attrs_);
+        return true;
+    }
+
+    ShadowAttrs attrs_;
+};
+
+// Creates a new entry on the shadow. The worker takes on the caller's
+// fs uid and gid for it, so the entry is created with the right owner
+// rather than chowned afterwards. Attribute changes that were queued
+// behind the create are folded into it, and a mode change goes into
+// the create itself.
+struct CreateOp : public ShadowCall {
+    CreateOp(const char* path, mode_t mode, uid_t uid, gid_t gid)
+        : ShadowCall(path) {
+        attrs_.set_mode(mode);
+        attrs_.set_owner(uid, gid);
+    }
+
+    int call();
+
+    void journal() {
+        journal_create();
+        ShadowAttrs rest = attrs_;
+        rest.set_ &= ~(ShadowAttrs::OWNER | (takes_mode() ? ShadowAttrs::MODE : 0));
+        rest.journal(path_.c_str());
+    }
+
+    bool absorb(const ShadowCall* later) {
+        const AttrOp* attr = dynamic_cast<const AttrOp*>(later);
+        if (attr == NULL || ! attrs_.can_merge(attr->attrs_)) {
+            return false;
+        }
+        attrs_.merge(attr->attrs_);
+        return true;
+    }
+
+    virtual int create(const std::string& shadow_path) = 0;
+    virtual void journal_create() = 0;
+    virtual const char* name() const = 0;
+
+    // Whether create applies the mode, or it has to be set afterwards
+    virtual bool takes_mode() const { return true; }
+
+    ShadowAttrs attrs_;
+};
+
+int
+CreateOp::call()
+{
+    std::string shadow_path = get_shadow_path(path_.c_str());
+    const char* path = path_.c_str();
+
+    bool as_caller;
+    int res;
+    {
+        ShadowCreds creds(attrs_.uid_, attrs_.gid_);
+        as_caller = creds.active_;
+        res = SHADOW_CALL(path, create(shadow_path));
+    }
+
+    // The caller may be missing permissions on the shadow that we have,
+    // for instance through a supplementary group, so try again as
+    // ourselves and chown instead.
+    if (res == -1 && as_caller && (errno == EACCES || errno == EPERM)) {
+        as_caller = false;
+        res = SHADOW_CALL(path, create(shadow_path));
+    }
+    if (res == -1) {
+        syslog(LOG_ERR, "error in shadow %s(%s): %s\n",
+               name(), shadow_path.c_str(), strerror(errno));
+        return res;
+    }
+
+    ShadowAttrs rest = attrs_;
+    if (as_caller) {
+        rest.set_ &= ~ShadowAttrs::OWNER;
+    }
+    if (takes_mode()) {
+        rest.set_ &= ~ShadowAttrs::MODE;
+    }
+    return rest.apply(path, shadow_path);
+}
+
+struct MknodOp : public CreateOp {
+    MknodOp(const char* path, mode_t mode, dev_t rdev, uid_t uid, gid_t gid)
+        : CreateOp(path, mode & ~S_IFMT, uid, gid), type_(mode & S_IFMT),
+          rdev_(rdev) {}
+
+    int create(const std::string& shadow_path) {
+        mode_t mode = type_ | (attrs_.mode_ & ~S_IFMT);
+        int res;
+
+        if (S_ISREG(mode)) {
+            res = open(shadow_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
+            if (res >= 0)
+                res = close(res);
+        } else if (S_ISFIFO(mode))
+            res = mkfifo(shadow_path.c_str(), mode);
+        else
+            res = mknod(shadow_path.c_str(), mode, rdev_);
+        return res;
+    }
+
+    void journal_create() {
+        journal_record(J_MKNOD, path_.c_str(), "",
+                       type_ | (attrs_.mode_ & ~S_IFMT), rdev_,
+                       attrs_.uid_, attrs_.gid_);
+    }
+
+    const char* name() const { return "mknod"; }
+
+    ShadowCall* clone() const { return new MknodOp(*this); }
+
+    mode_t type_;
+    dev_t  rdev_;
+};
+
+struct MkdirOp : public CreateOp {
+    MkdirOp(const char* path, mode_t mode, uid_t uid, gid_t gid)
+        : CreateOp(path, mode, uid, gid) {}
+
+    int create(const std::string& shadow_path) {
+        return mkdir(shadow_path.c_str(), attrs_.mode_);
+    }
+
+    void journal_create() {
+        journal_record(J_MKDIR, path_.c_str(), "", attrs_.mode_,
+                       attrs_.uid_, attrs_.gid_);
+    }
+
+    const char* name() const { return "mkdir"; }
+
+    ShadowCall* clone() const { return new MkdirOp(*this); }
+};
+
+// Once a path is removed, the ops still queued for it don't matter,
+// other than a rename that moves it out of the way first.
+static bool removal_supersedes(const ShadowCall* op);
+
+struct UnlinkOp : public ShadowCall {
+    UnlinkOp(const char* path) : ShadowCall(path) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        int res = SHADOW_CALL(path_.c_str(), unlink(shadow_path.c_str()));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow unlink(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_UNLINK, path_.c_str());
+    }
+
+    ShadowCall* clone() const { return new UnlinkOp(*this); }
+
+    bool retryable(int err) const { return err != ENOENT; }
+    bool supersedes(const ShadowCall* op) const { return removal_supersedes(op); }
+};
+
+struct RmdirOp : public ShadowCall {
+    RmdirOp(const char* path) : ShadowCall(path) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        int res = SHADOW_CALL(path_.c_str(), rmdir(shadow_path.c_str()));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow rmdir(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_RMDIR, path_.c_str());
+    }
+
+    ShadowCall* clone() const { return new RmdirOp(*this); }
+
+    bool retryable(int err) const { return err != ENOENT; }
+    bool supersedes(const ShadowCall* op) const { return removal_supersedes(op); }
+};
+
+// A chmod or utimens of a symlink applies to its target, so those are
+// still done after the link is created.
+struct SymlinkOp : public CreateOp {
+    SymlinkOp(const char* from, const char* to, uid_t uid, gid_t gid)
+        : CreateOp(to, 0, uid, gid), from_(from) {
+        attrs_.set_ &= ~ShadowAttrs::MODE;
+    }
+
+    int create(const std::string& shadow_to) {
+        return symlink(from_.c_str(), shadow_to.c_str());
+    }
+
+    void journal_create() {
+        journal_record(J_SYMLINK, path_.c_str(), from_.c_str(),
+                       attrs_.uid_, attrs_.gid_);
+    }
+
+    const char* name() const { return "symlink"; }
+    bool takes_mode() const { return false; }
+
+    ShadowCall* clone() const { return new SymlinkOp(*this); }
+
+    std::string from_;
+};
+
+// Renames are queued behind the source path so they are applied after
+// any pending writes to the file under its old name.
+struct RenameOp : public ShadowCall {
+    RenameOp(const char* from, const char* to)
+        : ShadowCall(from), to_(to) {}
+
+    int call() {
+        std::string shadow_from = get_shadow_path(path_.c_str());
+        std::string shadow_to   = get_shadow_path(to_.c_str());
+
+        int res = SHADOW_CALL(to_.c_str(), rename(shadow_from.c_str(),
+                                                  shadow_to.c_str()));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow rename(%s -> %s): %s\n",
+                   path_.c_str(), shadow_to.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_RENAME, path_.c_str(), to_.c_str());
+    }
+
+    ShadowCall* clone() const { return new RenameOp(*this); }
+
+    void retarget(const std::string& target) {
+        ShadowCall::retarget(target);
+        to_ = target_path(to_, target);
+    }
+
+    void abandon() {
+        ShadowCall::abandon();
+        index_change(to_.c_str());
+    }
+
+    std::string to_;
+};
+
+static bool
+removal_supersedes(const ShadowCall* op)
+{
+    return dynamic_cast<const RenameOp*>(op) == NULL;
+}
+
+struct LinkOp : public ShadowCall {
+    LinkOp(const char* from, const char* to, uid_t uid, gid_t gid)
+        : ShadowCall(to), from_(from), uid_(uid), gid_(gid) {}
+
+    int call() {
+        std::string shadow_from = get_shadow_path(from_.c_str());
+        std::string shadow_to   = get_shadow_path(path_.c_str());
+        const char* to = path_.c_str();
+
+        int res = SHADOW_CALL(to, link(shadow_from.c_str(), shadow_to.c_str()));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow link(%s -> %s): %s\n",
+                   from_.c_str(), shadow_to.c_str(), strerror(errno));
+            return res;
+        }
+
+        return SHADOW_CALL(to, chown(shadow_to.c_str(), uid_, gid_));
+    }
+
+    void journal() {
+        journal_record(J_LINK, from_.c_str(), path_.c_str(), uid_, gid_);
+    }
+
+    ShadowCall* clone() const { return new LinkOp(*this); }
+
+    void retarget(const std::string& target) {
+        ShadowCall::retarget(target);
+        from_ = target_path(from_, target);
+    }
+
+    std::string from_;
+    uid_t       uid_;
+    gid_t       gid_;
+};
+
+struct TruncateOp : public ShadowCall {
+    TruncateOp(const char* path, off_t size)
+        : ShadowCall(path), size_(size) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        int res = SHADOW_CALL(path_.c_str(),
+                              truncate(shadow_path.c_str(), size_));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow truncate(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_TRUNCATE, path_.c_str(), "", size_);
+    }
+
+    ShadowCall* clone() const { return new TruncateOp(*this); }
+    bool supersedes(const ShadowCall* op) const {
+        return dynamic_cast<const TruncateOp*>(op) != NULL;
+    }
+
+    off_t size_;
+};
+
+// Opens (or creates) the shadow file. The fd is handed over to the
+// caller if it is still waiting once the open completes, otherwise it
+// is closed again when the op is deleted.
+struct OpenOp : public ShadowCall {
+    OpenOp(const char* path, int flags, mode_t mode, bool create,
+           uid_t uid, gid_t gid)
+        : ShadowCall(path), flags_(flags), mode_(mode), create_(create),
+          uid_(uid), gid_(gid), fd_(-1) {}
+
+    ~OpenOp() {
+        if (fd_ != -1) {
+            close(fd_);
+        }
+    }
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+        const char* op = create_ ? "creat" : "open";
+
+        if (! create_) {
+            fd_ = SHADOW_CALL(path_.c_str(), open(shadow_path.c_str(), flags_));
+        } else {
+            // as with CreateOp, the file is created as the caller where
+            // we can, and chowned to them where we can't
+            bool as_caller;
+            {
+                ShadowCreds creds(uid_, gid_);
+                as_caller = creds.active_;
+                fd_ = SHADOW_CALL(path_.c_str(),
+                                  creat(shadow_path.c_str(), mode_));
+            }
+            if (fd_ == -1 && as_caller && (errno == EACCES || errno == EPERM)) {
+                as_caller = false;
+                fd_ = SHADOW_CALL(path_.c_str(),
+                                  creat(shadow_path.c_str(), mode_));
+            }
+            if (fd_ != -1 && ! as_caller && fchown(fd_, uid_, gid_) != 0) {
+                dsyslog("error in shadow fchown(%s): %s\n",
+                        shadow_path.c_str(), strerror(errno));
+            }
+        }
+        dsyslog("shadow %s(%s) returned %d\n", op, shadow_path.c_str(), fd_);
+
+        if (fd_ == -1) {
+            syslog(LOG_ERR, "error in shadow %s(%s): %s\n",
+                   op, shadow_path.c_str(), strerror(errno));
+        }
+        return fd_;
+    }
+
+    void journal() {
+        journal_open(path_.c_str(), flags_, mode_, create_, uid_, gid_);
+    }
+
+    int    flags_;
+    mode_t mode_;
+    bool   create_;
+    uid_t  uid_;
+    gid_t  gid_;
+    int    fd_;
+};
+
+struct FsyncOp : public ShadowCall {
+    FsyncOp(const char* path, int fd)
+        : ShadowCall(path), fd_(fd) {}
+
+    int call() {
+        int res = SHADOW_CALL(path_.c_str(), fsync(fd_));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow fsync(%s): %s\n",
+                    path_.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {}
+
+    int fd_;
+};
+
+int
+CopyFileOp::call()
+{
+    std::string local_path  = get_local_path(path_.c_str());
+    std::string shadow_path = get_shadow_path(path_.c_str());
+    const char* path = path_.c_str();
+
+    struct stat st;
+    int local_fd = source_fd_ != -1 ? dup(source_fd_)
+                                    : open(local_path.c_str(), O_RDONLY);
+    if (local_fd == -1 || fstat(local_fd, &st) != 0) {
+        // removed since, which the shadow will hear about anyway
+        dsyslog("copy: can't open %s: %s\n",
+                local_path.c_str(), strerror(errno));
+        if (local_fd != -1) {
+            close(local_fd);
+        }
+        return 0;
+    }
+
+    std::string tmp_path;
+    int shadow_fd;
+    if (in_place_) {
+        shadow_fd = SHADOW_CALL(path, open(shadow_path.c_str(),
+                                           O_WRONLY | O_CREAT | O_TRUNC,
+                                           st.st_mode & 07777));
+    } else {
+        size_t slash = shadow_path.rfind('/');
+        tmp_path = shadow_path.substr(0, slash + 1) + "." +
+                   shadow_path.substr(slash + 1) + ".shadowfs-XXXXXX";
+        shadow_fd = SHADOW_CALL(path, mkstemp(&tmp_path[0]));
+    }
+    if (shadow_fd == -1) {
+        int err = errno;
+        syslog(LOG_ERR, "error in shadow copy open(%s): %s\n",
+               shadow_path.c_str(), strerror(err));
+        close(local_fd);
+        errno = err;
+        return -1;
+    }
+
+    int res = 0;
+    throttle(path, st.st_size, 0);
+    if (SHADOW_COPY(path, st.st_size,
+                    copy_range(local_fd, shadow_fd, 0, st.st_size)) == -1)
+    {
+        syslog(LOG_ERR, "error in shadow copy write(%s): %s\n",
+               shadow_path.c_str(), strerror(errno));
+        res = -1;
+    }
 
-struct ShadowFileState {
-    int local_fd;
-    int shadow_fd;
-    bool offline;
+    if (res == 0) {
+        struct timeval tv[2];
+        tv[0].tv_sec  = st.st_atime;
+        tv[0].tv_usec = 0;
+        tv[1].tv_sec  = st.st_mtime;
+        tv[1].tv_usec = 0;
+        if (fchown(shadow_fd, st.st_uid, st.st_gid) != 0) {
+            dsyslog("copy: error in fchown(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        if (fchmod(shadow_fd, st.st_mode & 07777) != 0 ||
+            futimes(shadow_fd, tv) != 0)
+        {
+            syslog(LOG_ERR, "error setting attributes of %s: %s\n",
+                   shadow_path.c_str(), strerror(errno));
+        }
+    }
+
+    int err = errno;
+    close(local_fd);
+    SHADOW_CALL(path, close(shadow_fd));
+
+    if (! tmp_path.empty()) {
+        if (res == 0 &&
+            SHADOW_CALL(path, rename(tmp_path.c_str(), shadow_path.c_str())) != 0)
+        {
+            err = errno;
+            syslog(LOG_ERR, "error in shadow copy rename(%s): %s\n",
+                   shadow_path.c_str(), strerror(err));
+            res = -1;
+        }
+        if (res == 0) {
+            drop_target_fd(path_);  // it's open on the file just replaced
+        }
+        if (res == -1) {
+            unlink(tmp_path.c_str());
+        }
+    }
+    
+    errno = err;
+    return res;
+}
+
+void
+CopyFileOp::journal()
+{
+    std::string local_path = get_local_path(path_.c_str());
+    struct stat st;
+    if (source_fd_ != -1 ? fstat(source_fd_, &st) != 0
+                         : stat(local_path.c_str(), &st) != 0)
+    {
+        return;
+    }
+    journal_record(J_MKNOD, path_.c_str(), "", S_IFREG | (st.st_mode & 07777),
+                   0, st.st_uid, st.st_gid);
+    journal_record(J_TRUNCATE, path_.c_str(), "", 0);
+    journal_record(J_WRITE, path_.c_str(), "", 0, st.st_size);
+}
+
+// The copy takes the file's attributes as they are when it runs
+bool
+CopyFileOp::absorb(const ShadowCall* later)
+{
+    return dynamic_cast<const AttrOp*>(later) != NULL;
+}
+
+off_t
+CopyFileOp::traffic() const
+{
+    std::string local_path = get_local_path(path_.c_str());
+    struct stat st;
+    if (source_fd_ != -1) {
+        return fstat(source_fd_, &st) == 0 ? st.st_size : 0;
+    }
+    return stat(local_path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Copies a whole file to the shadow, either waiting for it as for
+// other shadow calls, or in the background. The op takes over
+// source_fd, see CopyFileOp.
+static void
+copy_file(const std::string& path, bool wait, bool in_place, int source_fd)
+{
+    if (wait) {
+        replicate_call(new CopyFileOp(path, in_place, source_fd));
+    } else {
+        replicate_async(new CopyFileOp(path, in_place, source_fd));
+    }
+}
+
+#ifdef HAVE_SETXATTR
+static std::string xattr_name(const ShadowCall* op);
+
+struct SetxattrOp : public ShadowCall {
+    SetxattrOp(const char* path, const char* name, const char* value,
+               size_t size, int flags)
+        : ShadowCall(path), name_(name), value_(value, size), flags_(flags) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        int res = SHADOW_CALL(path_.c_str(),
+                              lsetxattr(shadow_path.c_str(), name_.c_str(),
+                                        value_.data(), value_.size(), flags_));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow setxattr(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_XATTR, path_.c_str(), name_.c_str());
+    }
+
+    ShadowCall* clone() const { return new SetxattrOp(*this); }
+    bool supersedes(const ShadowCall* op) const {
+        return xattr_name(op) == name_;
+    }
+
+    std::string name_;
+    std::string value_;
+    int         flags_;
+};
+
+struct RemovexattrOp : public ShadowCall {
+    RemovexattrOp(const char* path, const char* name)
+        : ShadowCall(path), name_(name) {}
+
+    int call() {
+        std::string shadow_path = get_shadow_path(path_.c_str());
+
+        int res = SHADOW_CALL(path_.c_str(),
+                              lremovexattr(shadow_path.c_str(), name_.c_str()));
+        if (res == -1) {
+            syslog(LOG_ERR, "error in shadow removexattr(%s): %s\n",
+                    shadow_path.c_str(), strerror(errno));
+        }
+        return res;
+    }
+
+    void journal() {
+        journal_record(J_XATTR, path_.c_str(), name_.c_str());
+    }
+
+    ShadowCall* clone() const { return new RemovexattrOp(*this); }
+    bool supersedes(const ShadowCall* op) const {
+        return xattr_name(op) == name_;
+    }
+
+    std::string name_;
 };
+// The attribute an earlier xattr op on the same path set or removed
+static std::string
+xattr_name(const ShadowCall* op)
+{
+    if (const SetxattrOp* set = dynamic_cast<const SetxattrOp*>(op)) {
+        return set->name_;
+    }
+    if (const RemovexattrOp* remove = dynamic_cast<const RemovexattrOp*>(op)) {
+        return remove->name_;
+    }
+    return "";
+}
+#endif /* HAVE_SETXATTR */
+
+// Opens the shadow side of a file that was opened for writing, or
+// journals the open if the shadow is offline or doesn't answer within
+// the deadline, in which case later writes to the file are journaled
+// as well.
+static void
+open_shadow(ShadowFileState* info, int flags, mode_t mode, bool create)
+{
+    const char* path = info->path.c_str();
+    fuse_context* ctx = fuse_get_context();
+    
+    if (shadow_offline(path)) {
+        journal_open(path, flags, mode, create, ctx->uid, ctx->gid);
+        info->offline = true;
+        return;
+    }
 
-typedef std::map<std::string, ShadowFileState*> OpenFileTable;
-OpenFileTable open_files_;
+    OpenOp* op = new OpenOp(path, flags, mode, create, ctx->uid, ctx->gid);
+    if (replicate_wait(op)) {
+        info->shadow_fd = op->fd_;
+        op->fd_ = -1;
+        delete op;
+    } else {
+        journal_open(path, flags, mode, create, ctx->uid, ctx->gid);
+        info->offline = true;
+    }
+}
+
+// Opens the local side of a file. Dirty extents are copied from the
+// local fd, so with delta_ms set write-only opens are made read-write
+// where the permissions allow it.
+static int
+open_local(const char* local_path, int flags, mode_t mode)
+{
+    if (_config.delta_ms_ != 0 && (flags & O_ACCMODE) == O_WRONLY) {
+        int fd = open(local_path, (flags & ~O_ACCMODE) | O_RDWR, mode);
+        if (fd != -1 || errno != EACCES) {
+            return fd;
+        }
+    }
+    return open(local_path, flags, mode);
+}
+
+// Opens the shadow fd of a file whose open was deferred, using the
+// flags it was originally opened with.
+static void
+ensure_shadow(ShadowFileState* info)
+{
+    pthread_mutex_lock(&info->open_lock);
+    if (info->open_pending) {
+        dsyslog("opening deferred shadow of %s\n", info->path.c_str());
+        open_shadow(info, info->open_flags, 0, false);
+        info->open_pending = false;
+    }
+    pthread_mutex_unlock(&info->open_lock);
+}
+
+// With write_behind, attribute changes aren't waited for either, which
+// lets a run of them on one path merge while they're queued.
+static void
+replicate_attrs(AttrOp* op)
+{
+    if (_config.write_behind_) {
+        replicate_async(op);
+    } else {
+        replicate_call(op);
+    }
+}
 
 static int shadow_getattr(const char *path, struct stat *stbuf)
 {
@@ -35,10 +1509,21 @@ static int shadow_getattr(const char *path, struct stat *stbuf)
 
     int res;
 
+    unsigned long epoch;
+    if (attr_cache_get(path, stbuf, &res, &epoch)) {
+        return res;
+    }
+
     res = lstat(local_path.c_str(), stbuf);
-    if (res == -1)
-        return -errno;
+    if (res == -1) {
+        res = -errno;
+        if (res == -ENOENT) {
+            negative_cache_put(path, epoch);
+        }
+        return res;
+    }
 
+    attr_cache_put(path, *stbuf, epoch);
     return 0;
 }
 
@@ -81,20 +1566,24 @@ static int shadow_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     (void) offset;
     (void) fi;
 
+    unsigned long epoch;
+    if (dir_cache_fill(path, buf, filler, &epoch)) {
+        return 0;
+    }
+
+    DirListing listing;
     dp = opendir(local_path.c_str());
     if (dp == NULL)
         return -errno;
 
     while ((de = readdir(dp)) != NULL) {
-        struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        st.st_mode = de->d_type << 12;
-        if (filler(buf, de->d_name, &st, 0))
-            break;
+        listing.add(de);
     }
 
     closedir(dp);
+    listing.fill(buf, filler);
+    prefetch_attrs(path, listing);
+    dir_cache_put(path, &listing, epoch);
     return 0;
 }
 
@@ -118,29 +1607,18 @@ static int shadow_mknod(const char *path, mode_t mode, dev_t rdev)
     if (res == -1)
         return -errno;
 
+    index_change(path);
+
     // Need to set permissions to the calling user
     fuse_context* ctx = fuse_get_context();
     chown(local_path.c_str(), ctx->uid, ctx->gid);
+    cache_invalidate_entry(path, false);
 
-    if (is_offline(path)) {
+    if (S_ISREG(mode) && settle_start(path)) {
         return 0;
     }
-    
-    std::string shadow_path = get_shadow_path(path);
 
-    if (S_ISREG(mode)) {
-        res = open(shadow_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
-        if (res >= 0)
-            res = close(res);
-    } else if (S_ISFIFO(mode))
-        res = mkfifo(shadow_path.c_str(), mode);
-    else
-        res = mknod(shadow_path.c_str(), mode, rdev);
-    if (res == -1)
-        syslog(LOG_ERR, "error in shadow mknod(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    
-    chown(shadow_path.c_str(), ctx->uid, ctx->gid);
+    replicate_call(new MknodOp(path, mode, rdev, ctx->uid, ctx->gid));
     return 0;
 }
 
@@ -151,63 +1629,46 @@ static int shadow_create(const char *path, mode_t mode, struct fuse_file_info *f
     ShadowFileState* info;
     int fd;
 
-    OpenFileTable::iterator iter = open_files_.find(std::string(path));
-    if (iter != open_files_.end()) {
-        // Something got screwed up in the fuse layer and it didn't
-        // properly call release() on the old file handle. The safe
-        // thing to do is to keep the ShadowFileState object around,
-        // but close the open file descriptors.
-        //syslog(LOG_ERR, "file %s opened multiple times (info %p)\n", path, info);
-        /*
-        if (close(info->local_fd) != 0) {
-            syslog(LOG_ERR, "error in close(%d): %s\n",
-                   info->local_fd, strerror(errno));
-        }
-
-        if (info->shadow_fd != -1 && close(info->shadow_fd) != 0) {
-            syslog(LOG_ERR, "error in close(%d): %s\n",
-                   info->shadow_fd, strerror(errno));
-        }
-        */
-    }
-
-    fd = creat(local_path.c_str(), mode);
+    fd = open_local(local_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, mode);
     // TODO remove flags?
     dsyslog("creat(%s) 0x%x returned %d\n", local_path.c_str(), fi->flags, fd);
     if (fd == -1)
         return -errno;
 
-    info = new ShadowFileState();
-    fi->fh = (uint64_t)info;
+    index_change(path);
+    cache_invalidate_entry(path, false);
 
+    info = new ShadowFileState();
+    info->path      = path;
     info->local_fd  = fd;
-    info->shadow_fd = -1;
-    info->offline   = false;
+    info->local_readable = (fcntl(fd, F_GETFL) & O_ACCMODE) != O_WRONLY;
 
-    open_files_[std::string(path)] = info;
+    add_open_file(fi, info);
 
     if ((fi->flags & O_ACCMODE) == O_RDONLY) {
         dsyslog("creat(%s) write-mode not set\n", local_path.c_str());
         return 0;
     }
 
-    if (is_offline(path)) {
-        info->offline = true;
+    // If the file outlives its settle window, the shadow copy will
+    // have been created by then and only needs opening.
+    if (settle_start(path)) {
+        info->open_pending = true;
+        info->open_flags   = fi->flags & ~(O_CREAT | O_EXCL | O_TRUNC);
         return 0;
     }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    fd = creat(shadow_path.c_str(), fi->flags);
-    dsyslog("shadow creat(%s) returned %d\n", shadow_path.c_str(), fd);
-
-    if (fd == -1) {
-        syslog(LOG_ERR, "error in shadow creat(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    } else {
-        info->shadow_fd = fd;
+    if (_config.stream_rewrites_ && ! shadow_offline(path)) {
+        info->rewrite    = true;
+        info->rewrite_fd = rewrite_source(info, local_path);
+        return 0;
     }
 
+    fuse_context* ctx = fuse_get_context();
+    replicate_targets_open(path, fi->flags, mode, true, ctx->uid, ctx->gid);
+    info->targets = true;
+
+    open_shadow(info, fi->flags, mode, true);
     return 0;
 }
 
@@ -221,24 +1682,14 @@ static int shadow_mkdir(const char *path, mode_t mode)
     if (res == -1)
         return -errno;
 
+    index_change(path);
+
     // Need to set permissions to the calling user
     fuse_context* ctx = fuse_get_context();
     chown(local_path.c_str(), ctx->uid, ctx->gid);
+    cache_invalidate_entry(path, false);
     
-    if (is_offline(path)) {
-        return 0;
-    }
-
-    std::string shadow_path = get_shadow_path(path);
-
-    res = mkdir(shadow_path.c_str(), mode);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow mkdir(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
-
-    chown(shadow_path.c_str(), ctx->uid, ctx->gid);
-    
+    replicate_call(new MkdirOp(path, mode, ctx->uid, ctx->gid));
     return 0;
 }
 
@@ -252,18 +1703,15 @@ static int shadow_unlink(const char *path)
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
-        return 0;
-    }
-
-    std::string shadow_path = get_shadow_path(path);
+    index_change(path);
+    cache_invalidate_entry(path, false);
 
-    res = unlink(shadow_path.c_str());
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow unlink(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
+    if (settle_drop(path)) {
+        dsyslog("unlink(%s): dropped settling file\n", path);
+        return 0;
     }
 
+    replicate_call(new UnlinkOp(path));
     return 0;
 }
 
@@ -277,18 +1725,10 @@ static int shadow_rmdir(const char *path)
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
-        return 0;
-    }
-
-    std::string shadow_path = get_shadow_path(path);
-
-    res = rmdir(shadow_path.c_str());
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow rmdir(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
+    index_change(path);
+    cache_invalidate_entry(path, true);
 
+    replicate_call(new RmdirOp(path));
     return 0;
 }
 
@@ -304,24 +1744,14 @@ static int shadow_symlink(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
+    index_change(to);
+
     // Need to set permissions to the calling user
     fuse_context* ctx = fuse_get_context();
     chown(local_to.c_str(), ctx->uid, ctx->gid);
+    cache_invalidate_entry(to, false);
     
-    if (is_offline(to)) {
-        return 0;
-    }
-
-    std::string shadow_to = get_shadow_path(to);
-
-    res = symlink(from, shadow_to.c_str());
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow symlink(%s -> %s): %s\n",
-               from, shadow_to.c_str(), strerror(errno));
-    }
-
-    chown(shadow_to.c_str(), ctx->uid, ctx->gid);
-    
+    replicate_call(new SymlinkOp(from, to, ctx->uid, ctx->gid));
     return 0;
 }
 
@@ -336,19 +1766,43 @@ static int shadow_rename(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
-    if (is_offline(to)) {
-        return 0;
-    }
+    index_change(from);
+    index_change(to);
+    cache_invalidate_entry(from, true);
+    cache_invalidate_entry(to, true);
 
-    std::string shadow_from = get_shadow_path(from);
-    std::string shadow_to   = get_shadow_path(to);
+    flush_stage_path(from);
+    flush_rewrites_path(from);
 
-    res = rename(shadow_from.c_str(), shadow_to.c_str());
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow rename(%s -> %s): %s\n",
-               from, shadow_to.c_str(), strerror(errno));
+    // Whatever was settling at the target has been replaced
+    settle_drop(to);
+    if (settle_drop(from)) {
+        dsyslog("rename(%s -> %s): copying settling file\n", from, to);
+        copy_file(to, true);
+        return 0;
+    }
+    settle_under(from);
+
+    // Background copies of files below a directory go through their
+    // own queues, so they have to land before the rename moves them.
+    // As for other callers, a deadline of 0 waits for as long as it
+    // takes.
+    struct stat st;
+    if (lstat(local_to.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        unsigned long mark = replicate_mark();
+        unsigned wait_ms = _config.deadline_ms_ != 0 ? _config.deadline_ms_
+                                                     : 1000;
+        bool done;
+        do {
+            done = replicate_barrier(from, mark, wait_ms);
+        } while (! done && _config.deadline_ms_ == 0);
+        if (! done) {
+            dsyslog("rename(%s -> %s): shadow still busy below %s\n",
+                    from, to, from);
+        }
     }
 
+    replicate_call(new RenameOp(from, to));
     return 0;
 }
 
@@ -363,25 +1817,16 @@ static int shadow_link(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
+    index_change(to);
+
     // Need to set permissions to the calling user
     fuse_context* ctx = fuse_get_context();
     chown(local_to.c_str(), ctx->uid, ctx->gid);
+    cache_invalidate(from);
+    cache_invalidate_entry(to, false);
 
-    if (is_offline(to)) {
-        return 0;
-    }
-
-    std::string shadow_from = get_shadow_path(from);
-    std::string shadow_to   = get_shadow_path(to);
-
-    res = link(shadow_from.c_str(), shadow_to.c_str());
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow link(%s -> %s): %s\n",
-               from, shadow_to.c_str(), strerror(errno));
-    }
-
-    chown(shadow_to.c_str(), ctx->uid, ctx->gid);
-    
+    settle_now(from);
+    replicate_call(new LinkOp(from, to, ctx->uid, ctx->gid));
     return 0;
 }
 
@@ -395,18 +1840,16 @@ static int shadow_chmod(const char *path, mode_t mode)
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
+    index_change(path);
+    cache_invalidate(path);
+
+    if (is_settling(path)) {
         return 0;
     }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    res = chmod(shadow_path.c_str(), mode);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow chmod(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
-    
+    AttrOp* op = new AttrOp(path);
+    op->attrs_.set_mode(mode);
+    replicate_attrs(op);
     return 0;
 }
 
@@ -420,17 +1863,16 @@ static int shadow_chown(const char *path, uid_t uid, gid_t gid)
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
+    index_change(path);
+    cache_invalidate(path);
+
+    if (is_settling(path)) {
         return 0;
     }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    res = chown(shadow_path.c_str(), uid, gid);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow chown(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
+    AttrOp* op = new AttrOp(path);
+    op->attrs_.set_owner(uid, gid);
+    replicate_attrs(op);
     return 0;
 }
 
@@ -444,18 +1886,15 @@ static int shadow_truncate(const char *path, off_t size)
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
+    index_change(path);
+    cache_invalidate(path);
+
+    if (is_settling(path)) {
         return 0;
     }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    res = truncate(shadow_path.c_str(), size);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow truncate(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
-    
+    flush_stage_path(path);
+    replicate_call(new TruncateOp(path, size));
     return 0;
 }
 
@@ -475,18 +1914,16 @@ static int shadow_utimens(const char *path, const struct timespec ts[2])
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
+    index_change(path);
+    cache_invalidate(path);
+
+    if (is_settling(path)) {
         return 0;
     }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    res = utimes(shadow_path.c_str(), tv);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow utimes(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
-    
+    AttrOp* op = new AttrOp(path);
+    op->attrs_.set_times(ts);
+    replicate_attrs(op);
     return 0;
 }
 
@@ -497,62 +1934,45 @@ static int shadow_open(const char *path, struct fuse_file_info *fi)
     ShadowFileState* info;
     int fd;
 
-    OpenFileTable::iterator iter = open_files_.find(std::string(path));
-    if (iter != open_files_.end()) {
-        // Something got screwed up in the fuse layer and it didn't
-        // properly call release() on the old file handle. The safe
-        // thing to do is to keep the ShadowFileState object around,
-        // but close the open file descriptors.
-        //syslog(LOG_ERR, "file %s opened multiple times (info %p)\n", path, info);
-        /*
-        if (close(info->local_fd) != 0) {
-            syslog(LOG_ERR, "error in close(%d): %s\n",
-                   info->local_fd, strerror(errno));
-        }
-
-        if (info->shadow_fd != -1 && close(info->shadow_fd) != 0) {
-            syslog(LOG_ERR, "error in close(%d): %s\n",
-                   info->shadow_fd, strerror(errno));
-        }
-        */
-    }
-
-    fd = open(local_path.c_str(), fi->flags);
+    fd = open_local(local_path.c_str(), fi->flags, 0);
     dsyslog("open(%s) 0x%x returned %d\n", local_path.c_str(), fi->flags, fd);
     if (fd == -1)
         return -errno;
 
+    if (fi->flags & O_TRUNC) {
+        index_change(path);
+        cache_invalidate(path);
+    }
+
     info = new ShadowFileState();
-    fi->fh = (uint64_t)info;
-    
+    info->path      = path;
     info->local_fd  = fd;
-    info->shadow_fd = -1;
-    info->offline   = false;
+    info->local_readable = (fcntl(fd, F_GETFL) & O_ACCMODE) != O_WRONLY;
 
-    open_files_[std::string(path)] = info;
+    add_open_file(fi, info);
 
     if ((fi->flags & O_ACCMODE) == O_RDONLY) {
         dsyslog("open(%s) write-mode not set\n", local_path.c_str());
         return 0;
     }
-    
-    if (is_offline(path)) {
-        info->offline = true;
-        return 0;
-    }
 
-    std::string shadow_path = get_shadow_path(path);
-
-    fd = open(shadow_path.c_str(), fi->flags);
-    dsyslog("shadow open(%s) returned %d\n", shadow_path.c_str(), fd);
-
-    if (fd == -1) {
-        syslog(LOG_ERR, "error in shadow open(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
+    // Lots of files are opened read-write and never written, so the
+    // shadow side is left until the first write, unless the open
+    // itself changes the file.
+    if ((fi->flags & O_TRUNC) && _config.stream_rewrites_ &&
+        ! shadow_offline(path))
+    {
+        info->rewrite    = true;
+        info->rewrite_fd = rewrite_source(info, local_path);
+    } else if (fi->flags & O_TRUNC) {
+        fuse_context* ctx = fuse_get_context();
+        replicate_targets_open(path, fi->flags, 0, false, ctx->uid, ctx->gid);
+        info->targets = true;
+        open_shadow(info, fi->flags, 0, false);
     } else {
-        info->shadow_fd = fd;
+        info->open_pending = true;
+        info->open_flags   = fi->flags;
     }
-    
     return 0;
 }
 
@@ -581,22 +2001,41 @@ static int shadow_write(const char *path, const char *buf, size_t size,
     if (res == -1)
         return -errno;
 
-    if (info->offline) {
+    index_change(path);
+    cache_invalidate(path);
+
+    // The whole file is copied once it has settled or been closed
+    if (is_settling(path) || info->rewrite) {
         return res;
     }
 
-    if (info->shadow_fd == -1) {
-        syslog(LOG_ERR, "shadow write(%s): no fd open for writing\n", path);
+    // The extra targets are sent the write whatever state the first
+    // one is in.
+    replicate_targets_write(path, buf, size, offset);
+    info->targets = true;
+
+    ensure_shadow(info);
+
+    // Files that were opened while the shadow was offline (or whose
+    // shadow open failed) have no shadow fd, so the write is recorded
+    // in the journal to be copied over later.
+    if (info->offline || info->shadow_fd == -1 || shadow_offline(path)) {
+        if (! info->offline && info->shadow_fd == -1) {
+            syslog(LOG_ERR, "shadow write(%s): no fd open for writing\n", path);
+        }
+        journal_record(J_WRITE, path, "", offset, size);
         return res;
     }
 
-    int res2 = pwrite(info->shadow_fd, buf, size, offset);
-
-    if (res2 == -1) {
-        syslog(LOG_ERR, "error in shadow write(%s): %s\n",
-                path, strerror(errno));
+    if (_config.delta_ms_ != 0 && info->local_readable) {
+        mark_dirty(info, size, offset);
+        return res;
     }
 
+    // With write-behind enabled this only queues the data for the
+    // replication workers, so the caller never waits on the shadow.
+    stage_write(info, buf, size, offset);
+
     return res;
 }
 
@@ -604,25 +2043,35 @@ static int shadow_release(const char *path, struct fuse_file_info *fi)
 {
     ShadowFileState* info = (ShadowFileState*)fi->fh;
 
+    // Dirty extents are copied from the local fd, so they have to be
+    // handed off before it's closed.
+    flush_stage(info);
+
     if (close(info->local_fd) != 0) {
         syslog(LOG_ERR, "error in close(%d): %s\n",
                 info->local_fd, strerror(errno));
     }
 
-    if (info->shadow_fd != -1 && close(info->shadow_fd) != 0) {
-        syslog(LOG_ERR, "error in close(%d): %s\n",
-                info->shadow_fd, strerror(errno));
+    // The shadow fd has to stay open until any queued writes have
+    // been applied, so the close goes through the same queue.
+    if (info->shadow_fd != -1) {
+        replicate_close(info->path, info->shadow_fd);
+    }
+    if (info->targets) {
+        replicate_targets_close(info->path.c_str());
+    }
+
+    // A rewritten file is streamed over in the background, since it
+    // could take longer than a caller should wait.
+    if (info->rewrite) {
+        copy_file(info->path, false, shadow_open_elsewhere(info),
+                  info->rewrite_fd);
+        info->rewrite_fd = -1;
     }
 
+    remove_open_file(fi);
     delete info;
-    fi->fh = 0;
 
-    int n = open_files_.erase(std::string(path));
-    if (n != 1) {
-        syslog(LOG_ERR, "error in release(%s): %d entries in open file table\n", 
-               path, n);
-    }
-            
     return 0;
 }
 
@@ -637,14 +2086,29 @@ static int shadow_fsync(const char *path, int isdatasync,
     if (res == -1)
         return -errno;
 
-    if (info->shadow_fd == -1)
+    if (is_settling(path)) {
+        return res;
+    }
+
+    if (info->rewrite) {
+        copy_file(info->path, true, shadow_open_elsewhere(info),
+                  rewrite_dup(info));
         return res;
+    }
+
+    ensure_shadow(info);
 
-    int res2 = fsync(info->shadow_fd);
+    if (info->shadow_fd == -1) {
+        journal_sync(path);
+        return res;
+    }
 
-    if (res2 == -1) {
-        syslog(LOG_ERR, "error in shadow fsync(%s): %s\n",
-                path, strerror(errno));
+    // The fsync is queued behind the file's pending writes, but the
+    // caller only waits for it up to the shadow deadline.
+    flush_stage(info);
+    FsyncOp* op = new FsyncOp(info->path.c_str(), info->shadow_fd);
+    if (replicate_wait(op)) {
+        delete op;
     }
 
     return res;
@@ -661,18 +2125,11 @@ static int shadow_setxattr(const char *path, const char *name, const char *value
     if (res == -1)
         return -errno;
 
-    if (is_offline(path)) {
-        return 0;
-    }
-
-    std::string shadow_path = get_shadow_path(path);
+    index_change(path);
+    cache_invalidate(path);
 
-    res = lsetxattr(shadow_path.c_str(), name, value, size, flags);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow setxattr(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
-    }
-    
+    settle_now(path);
+    replicate_call(new SetxattrOp(path, name, value, size, flags));
     return 0;
 }
 
@@ -704,22 +2161,91 @@ static int shadow_removexattr(const char *path, const char *name)
     int res = lremovexattr(local_path.c_str(), name);
     if (res == -1)
         return -errno;
+
+    index_change(path);
+    cache_invalidate(path);
     
-    if (is_offline(path)) {
-        return 0;
+    settle_now(path);
+    replicate_call(new RemovexattrOp(path, name));
+    return 0;
+}
+#endif /* HAVE_SETXATTR */
+
+void start_shadow_ops()
+{
+    if (_config.coalesce_kb_ == 0 && _config.settle_ms_ == 0 &&
+        _config.delta_ms_ == 0)
+    {
+        return;
     }
 
-    std::string shadow_path = get_shadow_path(path);
+    flusher_running_ = true;
+    int err = pthread_create(&flusher_, NULL, stage_flusher, NULL);
+    if (err != 0) {
+        syslog(LOG_ERR, "error in pthread_create: %s\n", strerror(err));
+        flusher_running_ = false;
+    }
+}
 
-    res = lremovexattr(shadow_path.c_str(), name);
-    if (res == -1) {
-        syslog(LOG_ERR, "error in shadow setxattr(%s): %s\n",
-                shadow_path.c_str(), strerror(errno));
+void stop_shadow_ops()
+{
+    if (! flusher_running_) {
+        return;
     }
-    
-    return 0;
+
+    pthread_mutex_lock(&stage_lock_);
+    flusher_running_ = false;
+    pthread_cond_signal(&flusher_cv_);
+    pthread_mutex_unlock(&stage_lock_);
+    pthread_join(flusher_, NULL);
+
+    settle_expired(NULL);
+}
+
+static bool
+path_under(const std::string& path, const std::string& dir)
+{
+    return path.compare(0, dir.size(), dir) == 0 &&
+        (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+// Sends everything that is being held back from the shadow at or below
+// dir on its way: staged writes, dirty extents, settling files and the
+// current contents of files being rewritten. Used by barriers, which
+// then only have to wait for the replication queues.
+void flush_under(const char* dir)
+{
+    StagedFlushList flushes;
+    pthread_mutex_lock(&stage_lock_);
+    take_matching_locked(path_under, dir, &flushes);
+    pthread_mutex_unlock(&stage_lock_);
+    ship_stage(&flushes);
+
+    std::map<std::string, int> rewrites;
+    for (int i = 0; i < OPEN_FILE_SHARDS; ++i) {
+        OpenFileShard* shard = &open_files_[i];
+        pthread_mutex_lock(&shard->lock_);
+        OpenFileTable::iterator iter;
+        for (iter = shard->files_.begin(); iter != shard->files_.end(); ++iter) {
+            ShadowFileState* info = iter->second;
+            if (info->rewrite && path_under(info->path, dir) &&
+                rewrites.find(info->path) == rewrites.end())
+            {
+                rewrites[info->path] = rewrite_dup(info);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock_);
+    }
+
+    std::map<std::string, int>::iterator iter;
+    for (iter = rewrites.begin(); iter != rewrites.end(); ++iter) {
+        copy_file(iter->first, false, shadow_open_path(iter->first, NULL),
+                  iter->second);
+    }
+
+    settle_now(dir);
+    settle_under(dir);
 }
-#endif /* HAVE_SETXATTR */
 
 struct fuse_operations shadow_ops;
 void init_shadow_ops()
@@ -45,8 +45,10 @@
 #include <syslog.h>
 #include <stdarg.h>
 
+#include <bitset>
 #include <map>
 #include <string>
+#include <vector>
 
 extern struct fuse_operations dispatch_ops;
 extern struct fuse_operations root_ops;
@@ -58,14 +60,76 @@ extern void init_root_ops();
 extern void init_shadow_ops();
 extern void init_config_ops();
 
+extern void start_shadow_ops();
+extern void stop_shadow_ops();
+extern void flush_under(const char* dir);
+
+// A list of gitignore-style patterns, compiled into a single automaton
+// so that a path is checked against all of them in one pass. Later
+// patterns take precedence, and a leading ! excludes a path again.
+struct PatternSet {
+    struct State {
+        State() : out_(-1), eps_(-1), accept_(-1) {}
+
+        std::bitset<256> step_;    // characters that lead to out_
+        std::bitset<256> loop_;    // characters that stay in this state
+        int              out_;
+        int              eps_;     // reached without consuming anything
+        int              accept_;  // pattern matched here, or -1
+    };
+
+    bool add(const std::string& pattern);
+    bool load(const std::string& file);
+    bool match(const char* path) const;  // path relative to the mount
+    bool empty() const { return negate_.empty(); }
+
+    int new_state();
+
+    std::vector<State> states_;
+    std::vector<int>   anchored_;  // start states of rooted patterns
+    std::vector<int>   floating_;  // start states of patterns at any depth
+    std::vector<bool>  negate_;
+    std::vector<bool>  dir_only_;
+};
+
+// A rate limit on shadow traffic. Callers take tokens as they go and
+// sleep off any deficit, so excess work is delayed rather than failed.
+struct TokenBucket {
+    TokenBucket() : rate_(0), tokens_(0) {
+        last_.tv_sec  = 0;
+        last_.tv_usec = 0;
+    }
+
+    double         rate_;    // tokens per second, 0 for no limit
+    double         tokens_;  // goes negative while callers wait
+    struct timeval last_;    // time of the last refill
+};
+
 struct MountInfo {
     MountInfo(const std::string& path = "")
-        : path_(path), online_(true) {}
+        : path_(path), online_(true), latency_ms_(0), error_rate_(0),
+          probing_(false), limits_checked_(0), limits_mtime_(-1),
+          throttled_ms_(0) {}
     
     std::string path_;
     bool        online_;
+    double      latency_ms_;  // moving average of shadow call latency
+    double      error_rate_;  // moving average of failed shadow calls
+    bool        probing_;     // a probe thread is checking the shadow
+    PatternSet  local_only_;  // paths never sent to the shadow
+    TokenBucket byte_bucket_;     // shadow bytes per second
+    TokenBucket op_bucket_;       // shadow ops per second
+    time_t      limits_checked_;  // last look at the mount's limits file
+    time_t      limits_mtime_;    // mtime of the limits file in use
+    unsigned long throttled_ms_;  // time ops have slept off the limits
+    std::string source_;   // mount this is an extra target of, if any
+    std::vector<std::string> targets_;  // the mount's extra targets
 };
 
+// The mount table is filled in before fuse_main and never changes
+// afterwards, so it's looked up without a lock. The health fields of
+// each MountInfo are protected by a lock in offline.cc, and the rate
+// limits by one in throttle.cc.
 typedef std::map<std::string, MountInfo> MountTable;
 extern MountTable _mtab;
 
@@ -86,14 +150,369 @@ inline std::string root_dir(const char* path)
 inline std::string get_shadow_path(const char* path)
 {
     std::string root = root_dir(path);
-    MountInfo& mi = _mtab[root];
-    return mi.path_ + (path + root.length() + 1);
+    MountTable::const_iterator iter = _mtab.find(root);
+    assert(iter != _mtab.end());
+    return iter->second.path_ + (path + root.length() + 1);
 }
 
 extern std::string DATA_DIR;
 
+// A mount can be replicated to several shadows. The first is the one
+// named after the mount, and each extra target <mount>@<name> has an
+// entry of its own in the mount table, so that it gets its own queues,
+// journal, health and limits. Paths of an extra target are those of
+// the mount with the root renamed, and are only used internally.
+inline std::string target_path(const std::string& path,
+                               const std::string& target)
+{
+    return "/" + target + path.substr(root_dir(path.c_str()).length() + 1);
+}
+
+inline bool is_target_path(const char* path)
+{
+    MountTable::const_iterator iter = _mtab.find(root_dir(path));
+    return iter != _mtab.end() && ! iter->second.source_.empty();
+}
+
+// The path of the local file a shadow path is replicated from
+inline std::string get_local_path(const char* path)
+{
+    std::string root = root_dir(path);
+    MountTable::const_iterator iter = _mtab.find(root);
+    if (iter == _mtab.end() || iter->second.source_.empty()) {
+        return DATA_DIR + path;
+    }
+    return DATA_DIR + "/" + iter->second.source_ + (path + root.length() + 1);
+}
+
+struct ShadowConfig {
+    ShadowConfig()
+        : write_behind_(0), repl_threads_(4), repl_queue_mb_(64),
+          coalesce_kb_(0), coalesce_ms_(50), trip_ms_(1000),
+          probe_secs_(5), deadline_ms_(2000), settle_ms_(0), delta_ms_(0),
+          stream_rewrites_(0), shadow_kbps_(0), shadow_ops_(0),
+          attr_cache_secs_(0), negative_cache_secs_(0), dir_cache_secs_(0),
+          prefetch_threads_(0) {}
+
+    int      write_behind_;   // defer shadow writes to the workers
+    unsigned repl_threads_;   // number of replication workers
+    unsigned repl_queue_mb_;  // memory cap on queued shadow writes
+    unsigned coalesce_kb_;    // size at which staged writes are flushed
+    unsigned coalesce_ms_;    // age at which staged writes are flushed
+    unsigned trip_ms_;        // shadow latency that takes a mount offline
+    unsigned probe_secs_;     // interval between probes of a tripped mount
+    unsigned deadline_ms_;    // max time a caller waits for the shadow
+    unsigned settle_ms_;      // time new files are held back from the shadow
+    unsigned delta_ms_;       // age at which dirty extents are shipped
+    int      stream_rewrites_;  // copy rewritten files whole on close
+    unsigned shadow_kbps_;    // default cap on shadow write bandwidth
+    unsigned shadow_ops_;     // default cap on shadow ops per second
+    unsigned attr_cache_secs_;  // lifetime of cached local attributes
+    unsigned negative_cache_secs_;  // lifetime of cached missing paths
+    unsigned dir_cache_secs_;  // lifetime of cached directory listings
+    unsigned prefetch_threads_;  // threads caching the attrs of listed entries
+};
+
+extern ShadowConfig _config;
+
+// An operation against the shadow copy that has been deferred to the
+// replication workers. Ops are queued per path so that all the
+// updates to a given file are applied in the order they were issued,
+// while different files can be replicated in parallel. Each mount
+// has its own queues and workers, and paths with small interactive
+// updates are served ahead of those with bulk work (see replicate.cc).
+struct ShadowOp {
+    ShadowOp(const std::string& path, size_t bytes = 0)
+        : path_(path), bytes_(bytes), waiting_(false), done_(false),
+          prio_(0), seq_(0) {}
+    virtual ~ShadowOp() {}
+
+    virtual void apply() = 0;
+
+    // Amount of data the op sends to the shadow
+    virtual off_t traffic() const { return bytes_; }
+
+    std::string path_;
+    size_t      bytes_;    // memory held by the op while queued
+    bool        waiting_;  // a caller is blocked in replicate_wait
+    bool        done_;     // applied, and now owned by that caller
+    int         prio_;     // scheduling class, set when queued
+    unsigned long seq_;    // order in which ops were queued
+};
+
+// A namespace or attribute change to the shadow. If the mount has gone
+// offline by the time it runs, or the server fails the call, the op is
+// recorded in the journal instead.
+struct ShadowCall : public ShadowOp {
+    ShadowCall(const std::string& path) : ShadowOp(path), retry_(false) {}
+
+    void apply();
+
+    virtual int  call() = 0;     // the syscall(s), -1 and errno on error
+    virtual void journal() = 0;  // journals the op
+
+    // A copy of the op to retry later, or NULL if it can't be retried
+    virtual ShadowCall* clone() const { return NULL; }
+
+    // Whether a failure with err is worth retrying
+    virtual bool retryable(int err) const { return err != EEXIST; }
+
+    // Whether this op makes an earlier, not yet applied op moot
+    virtual bool supersedes(const ShadowCall*) const { return false; }
+
+    // Folds a later op on the same path into this one while it's still
+    // queued, returning true if it did, so both cost one shadow update
+    virtual bool absorb(const ShadowCall*) { return false; }
+
+    // Points a copy of the op at another target of the mount
+    virtual void retarget(const std::string& target) {
+        path_ = target_path(path_, target);
+    }
+
+    // Leaves the paths the op changes to reconcile, once retrying it
+    // has been given up on
+    virtual void abandon();
+
+    bool retry_;  // a resubmission from the retry queue
+};
+
+// Takes on the fs uid and gid of the user a shadow entry is created
+// for, on the current thread only, so that it's created with the right
+// owner. This needs root and per-thread fs ids (Linux); active_ says
+// whether it worked, and otherwise the entry has to be chowned.
+struct ShadowCreds {
+    ShadowCreds(uid_t uid, gid_t gid);
+    ~ShadowCreds();
+
+    bool  active_;
+    uid_t old_uid_;
+    gid_t old_gid_;
+};
+
+// A set of non-overlapping byte ranges of a file. Adjacent and
+// overlapping ranges are merged as they are added.
+struct ExtentSet {
+    typedef std::map<off_t, off_t> ExtentMap;  // start -> end
+
+    void add(off_t offset, off_t length);
+    void truncate(off_t size);
+    off_t bytes() const;
+    void clear() { extents_.clear(); }
+    bool empty() const { return extents_.empty(); }
+
+    ExtentMap extents_;
+};
+
+#define COPY_CHUNK (1024 * 1024)  // unit of file copies to the shadow
+
+extern ssize_t copy_range(int in_fd, int out_fd, off_t offset, off_t length);
+
+// Copies the whole of a file from the local copy to the shadow, along
+// with its mode, owner and times, replacing whatever is there. The
+// copy is written under a temporary name and renamed into place, so
+// readers of the shadow never see it half written, unless in_place is
+// set because the shadow file is open elsewhere and has to keep its
+// identity.
+// source_fd, if given, is a read-only fd on the local file that the op
+// takes over, so that the copy still finds the contents if the file is
+// renamed or replaced before the op runs. Otherwise the file is opened
+// by path when the copy runs.
+struct CopyFileOp : public ShadowCall {
+    CopyFileOp(const std::string& path, bool in_place = false,
+               int source_fd = -1)
+        : ShadowCall(path), in_place_(in_place), source_fd_(source_fd) {}
+    CopyFileOp(const CopyFileOp& other)
+        : ShadowCall(other), in_place_(other.in_place_),
+          source_fd_(other.source_fd_ == -1 ? -1 : dup(other.source_fd_)) {}
+    ~CopyFileOp() {
+        if (source_fd_ != -1) {
+            close(source_fd_);
+        }
+    }
+
+    int  call();
+    void journal();
+    off_t traffic() const;
+    bool absorb(const ShadowCall* later);
+    ShadowCall* clone() const { return new CopyFileOp(*this); }
+
+    bool in_place_;
+    int  source_fd_;
+
+private:
+    CopyFileOp& operator=(const CopyFileOp&);
+};
+
+extern void start_replication();
+extern void stop_replication();
+extern void replicate_write(const std::string& path, int fd, const char* buf,
+                            size_t size, off_t offset);
+extern void replicate_extents(const std::string& path, int local_fd,
+                              int shadow_fd, const ExtentSet& dirty);
+extern void replicate_close(const std::string& path, int fd);
+extern void replicate_flush(const std::string& path);
+extern unsigned long replicate_mark();
+extern bool replicate_barrier(const std::string& dir, unsigned long mark,
+                              unsigned wait_ms);
+extern void replicate_op(ShadowOp* op);
+extern bool replicate_wait(ShadowOp* op);
+extern void replicate_call(ShadowCall* op);
+extern void replicate_async(ShadowCall* op);
+
+// Writes to a mount's extra targets don't go through the caller's
+// open file, see replicate.cc.
+extern void replicate_targets_open(const char* path, int flags, mode_t mode,
+                                   bool create, uid_t uid, gid_t gid);
+extern void replicate_targets_write(const char* path, const char* buf,
+                                    size_t size, off_t offset);
+extern void replicate_targets_close(const char* path);
+extern void drop_target_fd(const std::string& path);
+
+// Shadow calls that failed are retried with exponential backoff, in
+// order per path.
+extern void start_retry();
+extern void stop_retry();
+extern bool retry_pending(const char* path);
+extern bool retry_pending_under(const std::string& dir);
+extern void retry_op(ShadowCall* op, bool failed);
+extern void retry_result(const std::string& path, bool done);
+
+// Mutations that could not be applied to the shadow because it was
+// offline are recorded in a per-mount journal and replayed once the
+// shadow comes back.
+enum JournalOp {
+    J_WRITE     = 'W',  // path offset length
+    J_TRUNCATE  = 'T',  // path size
+    J_MKNOD     = 'N',  // path mode rdev uid gid
+    J_MKDIR     = 'D',  // path mode uid gid
+    J_UNLINK    = 'U',  // path
+    J_RMDIR     = 'R',  // path
+    J_SYMLINK   = 'S',  // path target uid gid
+    J_RENAME    = 'M',  // path newpath
+    J_LINK      = 'L',  // path newpath uid gid
+    J_CHMOD     = 'C',  // path mode
+    J_CHOWN     = 'O',  // path uid gid
+    J_UTIMENS   = 'A',  // path atime atime_ns mtime mtime_ns
+    J_XATTR     = 'X',  // path name
+};
+
+extern void start_journal();
+extern void stop_journal();
+extern bool journal_pending(const char* path);
+extern bool shadow_offline(const char* path);
+extern void journal_sync(const char* path);
+extern void journal_open(const char* path, int flags, mode_t mode, bool create,
+                         uid_t uid, gid_t gid);
+extern void journal_record(JournalOp op, const char* path,
+                           const char* path2 = "",
+                           long long a = 0, long long b = 0,
+                           long long c = 0, long long d = 0);
+extern void escape_path(std::string* out, const std::string& s);
+extern std::string unescape_path(const std::string& s);
+
+// The change index records which paths of each mount were modified,
+// stamped with a per-mount sequence number, so that --reconcile only
+// has to look at what changed since it last verified the mount.
+typedef std::map<std::string, unsigned long long> ChangeMap;  // path -> seq
+
+// A node of the hash tree built from a mount's changes. local_ hashes
+// the changes at and below the node, shadow_ the ones that have been
+// verified, so a subtree needs checking only where the two differ.
+struct IndexNode {
+    IndexNode() : local_(0), shadow_(0), changed_(false) {}
+    ~IndexNode();
+
+    typedef std::map<std::string, IndexNode*> Children;
+
+    unsigned long long local_;
+    unsigned long long shadow_;
+    bool               changed_;  // the path itself changed since verified
+    Children           children_;
+};
+
+extern void start_index();
+extern void stop_index();
+extern void index_change(const char* path);
+extern bool read_index(const std::string& root, ChangeMap* changes);
+extern void read_verified(const std::string& root, ChangeMap* verified);
+extern void write_verified(const std::string& root, const ChangeMap& verified);
+extern void build_index_tree(const std::string& root, const ChangeMap& changes,
+                             const ChangeMap& verified, IndexNode* tree);
+
 extern bool is_offline(const char* path);
+extern bool is_local_only(const char* path);
+extern void load_local_only(MountInfo* mi, const std::string& file);
 extern void toggle_all_offline(int);
+extern void shadow_result(const char* path, const struct timeval* start, int err,
+                          off_t bytes = 0);
+extern void trip_mount(const char* path, const char* reason);
+extern void (*_on_trip)(const char* path);
+extern bool is_transport_error(int err);
+extern void throttle(const char* path, size_t bytes, unsigned ops);
+extern unsigned long throttled_ms(const char* path);
+
+// Local attributes, and paths known to be missing, are cached for
+// getattr and dropped by the ops that change them (see cache.cc).
+extern bool attr_cache_get(const char* path, struct stat* st, int* err,
+                           unsigned long* epoch);
+extern void attr_cache_put(const char* path, const struct stat& st, unsigned long epoch);
+extern void negative_cache_put(const char* path, unsigned long epoch);
+
+// A directory's entries as readdir returned them, with the names packed
+// back to back in one buffer rather than allocated one by one.
+struct DirListing {
+    struct Entry {
+        size_t        name_;  // offset in names_
+        ino_t         ino_;
+        unsigned char type_;
+    };
+
+    void add(const struct dirent* de);
+    void fill(void* buf, fuse_fill_dir_t filler) const;
+
+    std::string        names_;
+    std::vector<Entry> entries_;
+};
+
+extern bool dir_cache_fill(const char* path, void* buf, fuse_fill_dir_t filler,
+                           unsigned long* epoch);
+extern void dir_cache_put(const char* path, DirListing* listing, unsigned long epoch);
+extern void prefetch_attrs(const char* path, const DirListing& listing);
+extern void start_prefetch();
+extern void stop_prefetch();
+extern void cache_invalidate(const char* path);
+extern void cache_invalidate_entry(const char* path, bool tree);
+
+extern int reconcile_main(int argc, char* argv[]);
+
+extern void start_barrier();
+extern void stop_barrier();
+extern int barrier_main(int argc, char* argv[]);
+
+// Evaluates a syscall against the shadow copy of path, feeding its
+// latency and outcome to the mount's circuit breaker.
+#define SHADOW_CALL(_path, _call) ({                            \
+    struct timeval _start;                                      \
+    gettimeofday(&_start, NULL);                                \
+    __typeof__(_call) _res = (_call);                           \
+    int _err = errno;                                           \
+    shadow_result(_path, &_start, _res == -1 ? _err : 0);       \
+    errno = _err;                                               \
+    _res;                                                       \
+})
+
+// Like SHADOW_CALL, for a call that moves _bytes of data. Only the
+// time per COPY_CHUNK counts towards the latency, so that copying a
+// large file to a healthy server doesn't look like a stalled one.
+#define SHADOW_COPY(_path, _bytes, _call) ({                    \
+    struct timeval _start;                                      \
+    gettimeofday(&_start, NULL);                                \
+    __typeof__(_call) _res = (_call);                           \
+    int _err = errno;                                           \
+    shadow_result(_path, &_start, _res == -1 ? _err : 0, _bytes); \
+    errno = _err;                                               \
+    _res;                                                       \
+})
 
 extern FILE* debugfd;
 extern int debug;
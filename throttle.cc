@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2009-2013 Riverbed Technology, Inc.
+ *
+ * This file is part of Shadowfs
+ *
+ * Shadowfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * Shadowfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Shadowfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shadowfs.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Shadow traffic is shaped per mount by two token buckets, one for
+// bytes written and one for operations, so that a bulk change like a
+// branch switch doesn't monopolize the filer. The limits come from
+// the shadow_kbps and shadow_ops options, and can be changed at
+// runtime by writing a $DATA_DIR/.throttle/<mount> file:
+//
+//   kbps 2048
+//   ops  200
+//
+// The file is checked at most once a second. A missing setting, or 0,
+// falls back to the option.
+
+static pthread_mutex_t throttle_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+set_rate(TokenBucket* b, double rate)
+{
+    if (b->rate_ != rate) {
+        b->rate_   = rate;
+        b->tokens_ = rate;
+    }
+}
+
+// Picks up changes to the mount's limits. Called with throttle_lock_
+// held.
+static void
+check_limits(const std::string& root, MountInfo* mi, time_t now)
+{
+    if (mi->limits_checked_ == now) {
+        return;
+    }
+    mi->limits_checked_ = now;
+
+    std::string file = DATA_DIR + "/.throttle/" + root;
+    struct stat st;
+    time_t mtime = stat(file.c_str(), &st) == 0 ? st.st_mtime : 0;
+    if (mtime == mi->limits_mtime_) {
+        return;
+    }
+    mi->limits_mtime_ = mtime;
+
+    unsigned kbps = 0, ops = 0;
+    FILE* fp = mtime ? fopen(file.c_str(), "r") : NULL;
+    if (fp != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char key[32];
+            unsigned value;
+            if (line[0] == '#' || sscanf(line, "%31s %u", key, &value) != 2) {
+                continue;
+            }
+            if (! strcmp(key, "kbps")) {
+                kbps = value;
+            } else if (! strcmp(key, "ops")) {
+                ops = value;
+            } else {
+                syslog(LOG_ERR, "%s: unknown setting %s\n", file.c_str(), key);
+            }
+        }
+        fclose(fp);
+    }
+
+    if (kbps == 0) {
+        kbps = _config.shadow_kbps_;
+    }
+    if (ops == 0) {
+        ops = _config.shadow_ops_;
+    }
+    set_rate(&mi->byte_bucket_, kbps * 1024.0);
+    set_rate(&mi->op_bucket_, ops);
+    syslog(LOG_NOTICE, "shadow limits for %s: %u kbps, %u ops/s (0 = none)\n",
+           root.c_str(), kbps, ops);
+}
+
+// Takes n tokens from the bucket and returns how long the caller has
+// to wait for them, in seconds.
+static double
+take(TokenBucket* b, double n, const struct timeval& now)
+{
+    if (b->rate_ == 0 || n == 0) {
+        return 0;
+    }
+
+    double elapsed = (now.tv_sec - b->last_.tv_sec) +
+                     (now.tv_usec - b->last_.tv_usec) / 1e6;
+    b->tokens_ = std::min(b->rate_, b->tokens_ + elapsed * b->rate_);
+    b->last_ = now;
+
+    b->tokens_ -= n;
+    return b->tokens_ < 0 ? -b->tokens_ / b->rate_ : 0;
+}
+
+// Accounts for bytes and ops about to be sent to the shadow of path,
+// sleeping for as long as its mount is over its limits.
+void
+throttle(const char* path, size_t bytes, unsigned ops)
+{
+    std::string root = root_dir(path);
+    MountTable::iterator iter = _mtab.find(root);
+    if (iter == _mtab.end()) {
+        return;
+    }
+    MountInfo* mi = &iter->second;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&throttle_lock_);
+    check_limits(root, mi, now.tv_sec);
+    double wait = std::max(take(&mi->byte_bucket_, bytes, now),
+                           take(&mi->op_bucket_, ops, now));
+    pthread_mutex_unlock(&throttle_lock_);
+
+    if (wait > 0) {
+        dsyslog("throttle(%s): waiting %.3fs\n", path, wait);
+        __sync_add_and_fetch(&mi->throttled_ms_, (unsigned long)(wait * 1000));
+        struct timespec ts;
+        ts.tv_sec  = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Total time ops on the mount of path have spent waiting for their
+// tokens, which replicate_wait doesn't hold against the shadow.
+unsigned long
+throttled_ms(const char* path)
+{
+    MountTable::iterator iter = _mtab.find(root_dir(path));
+    if (iter == _mtab.end()) {
+        return 0;
+    }
+    return __sync_add_and_fetch(&iter->second.throttled_ms_, 0);
+}